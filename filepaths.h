@@ -1177,7 +1177,9 @@ filepath_list_new(const char *list)
 		return plist;
 	}
 
-	/* count PATH separators */
+	/* count PATH separators, there's one more entry than separators */
+	plist->size = 1;
+
 	for (ptr = (char *)list; *ptr != '\0'; ptr++)
 	{
 		if (*ptr == ':')
@@ -1187,18 +1189,34 @@ filepath_list_new(const char *list)
 	}
 	plist->list = (Path **) malloc(plist->size * sizeof(Path *));
 
-	i = 0;
-    while ((ptr = strchr(previous, ':')) != NULL)
+	for (i = 0; i < plist->size; i++)
 	{
-        size_t size = ptr - previous;
-		char *entry = (char *) malloc((size+1) * sizeof(char));
+		size_t size;
+		char *entry;
+
+		if ((ptr = strchr(previous, ':')) == NULL)
+		{
+			ptr = previous + strlen(previous);
+		}
+		size = ptr - previous;
+
+		/* an empty entry is the current directory */
+		if (size == 0)
+		{
+			entry = strdup(".");
+		}
+		else
+		{
+			entry = (char *) malloc((size+1) * sizeof(char));
 
-		strncpy(entry, previous, size);
-		entry[size] = '\0';
+			strncpy(entry, previous, size);
+			entry[size] = '\0';
+		}
 
-		plist->list[i++] = filepath_newdir(entry);
+		plist->list[i] = filepath_newdir(entry);
+		free(entry);
 
-		previous = ++ptr;
+		previous = ptr + 1;
 	}
 
 	return plist;
@@ -1210,8 +1228,9 @@ filepath_list_free(PathList *plist)
 {
 	for (int i = 0; i < plist->size; i++)
 	{
-		free(plist->list[i]);
+		filepath_free(plist->list[i]);
 	}
+	free(plist->list);
 	free(plist);
 	return;
 }
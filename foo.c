@@ -7,9 +7,13 @@
 
 #include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 #define COMMAND_LINE_IMPLEMENTATION
 #include "commandline.h"
@@ -24,6 +28,25 @@ static bool ls_opt_all = false;
 static bool ls_opt_long = false;
 static bool ls_opt_recursive = false;
 
+static bool run_opt_setsid = false;
+static bool run_opt_posix_spawn = false;
+static int run_opt_timeout = 0;
+static size_t run_opt_memory_limit = 0;
+static size_t run_opt_stdout_tail = 0;
+static size_t run_opt_stderr_tail = 0;
+static size_t run_opt_buffer = 0;
+static char *run_opt_output = NULL;
+static size_t run_opt_preview = 0;
+static char *run_opt_input = NULL;
+static bool run_opt_stdin = false;
+static bool run_opt_usage = false;
+static bool run_opt_io_uring = false;
+static bool run_opt_records = false;
+static bool run_opt_builtins = false;
+static char *run_opt_cache = NULL;
+static char *run_opt_depends[16] = { NULL };
+static int run_opt_depends_count = 0;
+
 static void main_env_get(int argc, char **argv);
 static void main_env_set(int argc, char **argv);
 
@@ -43,6 +66,31 @@ static int ls_getopt(int argc, char **argv);
 
 static void main_which(int argc, char **argv);
 static void main_echo12(int argc, char **argv);
+static void main_run(int argc, char **argv);
+static int run_getopt(int argc, char **argv);
+static void main_stream(int argc, char **argv);
+static void main_batch(int argc, char **argv);
+static void main_async(int argc, char **argv);
+static void main_pipeline(int argc, char **argv);
+static void main_cut(int argc, char **argv);
+static void main_xargs(int argc, char **argv);
+static void main_coproc(int argc, char **argv);
+
+static void main_bench_spawn(int argc, char **argv);
+static void main_bench_template(int argc, char **argv);
+static void main_bench_fds(int argc, char **argv);
+static void main_bench_capture(int argc, char **argv);
+static void main_bench_coprocess(int argc, char **argv);
+static void main_bench_ring(int argc, char **argv);
+static void main_bench_lines(int argc, char **argv);
+static void main_bench_cache(int argc, char **argv);
+static void main_bench_builtin(int argc, char **argv);
+static void print_program_usage(FILE *stream, Program *prog);
+static void print_program_records(FILE *stream, Program *prog);
+static Program initialize_command_line(const char *line, int position);
+static void async_update_epoll(int epfd, int index,
+							   struct pollfd *before, struct pollfd *after);
+static double elapsed_usecs(struct timespec *start, struct timespec *end);
 
 CommandLine env_cmd_get = make_command("get",
 									   "get env variable value",
@@ -156,6 +204,129 @@ CommandLine echo_cmd = make_command("echo",
 									"run /usr/bin/echo", "<nb>", NULL,
 									NULL, &main_echo12);
 
+CommandLine run_cmd = make_command("run",
+								   "run a program and capture its output",
+								   "[--setsid] [--posix-spawn] "
+								   "[--timeout ms] [--memory-limit bytes] "
+								   "[--stdout-tail bytes] [--stderr-tail bytes] "
+								   "[--buffer bytes] "
+								   "[--output file [--preview bytes]] "
+								   "[--input file | --stdin] [--usage] "
+								   "[--io-uring] [--records] [--builtins] "
+								   "[--cache file [--depends file ...]] "
+								   "<program> [ args ... ]", NULL,
+								   &run_getopt, &main_run);
+
+CommandLine stream_cmd = make_command("stream",
+									  "run a program and stream its output",
+									  "<program> [ args ... ]", NULL,
+									  NULL, &main_stream);
+
+CommandLine batch_cmd = make_command("batch",
+									 "run several programs concurrently",
+									 "<parallel> <command line> [ ... ]", NULL,
+									 NULL, &main_batch);
+
+CommandLine async_cmd = make_command("async",
+									 "run several programs from an epoll loop",
+									 "<command line> [ ... ]", NULL,
+									 NULL, &main_async);
+
+CommandLine pipeline_cmd = make_command("pipeline",
+										"run programs connected with pipes",
+										"<program> [ args ... ] "
+										"[ \"|\" <program> [ args ... ] ... ]",
+										NULL,
+										NULL, &main_pipeline);
+
+CommandLine cut_cmd = make_command("cut",
+								   "display a field of each line of a program output",
+								   "<delimiter> <field> <program> [ args ... ]",
+								   NULL,
+								   NULL, &main_cut);
+
+CommandLine xargs_cmd = make_command("xargs",
+									 "run a program over the lines of stdin, in batches",
+									 "<parallel> <program> [ args ... ]",
+									 NULL,
+									 NULL, &main_xargs);
+
+CommandLine coproc_cmd = make_command("coproc",
+									  "send each line of stdin to a co-process",
+									  "<program> [ args ... ]", NULL,
+									  NULL, &main_coproc);
+
+CommandLine bench_cmd_spawn = make_command("spawn",
+											"compare fork() and posix_spawn() latency",
+											"[iterations]",
+											NULL,
+											NULL, &main_bench_spawn);
+
+CommandLine bench_cmd_template = make_command("template",
+											   "compare command templates and run_program",
+											   "[iterations]",
+											   NULL,
+											   NULL, &main_bench_template);
+
+CommandLine bench_cmd_fds = make_command("fds",
+										  "measure closing inherited descriptors",
+										  "[count]",
+										  NULL,
+										  NULL, &main_bench_fds);
+
+CommandLine bench_cmd_capture = make_command("capture",
+											  "compare fixed and adaptive read sizes",
+											  "[megabytes]",
+											  NULL,
+											  NULL, &main_bench_capture);
+
+CommandLine bench_cmd_coprocess = make_command("coprocess",
+												"compare co-process calls and run_program",
+												"[iterations]",
+												NULL,
+												NULL, &main_bench_coprocess);
+
+CommandLine bench_cmd_ring = make_command("ring",
+										   "compare the poll() loop and io_uring",
+										   "[megabytes]",
+										   NULL,
+										   NULL, &main_bench_ring);
+
+CommandLine bench_cmd_lines = make_command("lines",
+											"measure splitting output in lines and fields",
+											"[megabytes]",
+											NULL,
+											NULL, &main_bench_lines);
+
+CommandLine bench_cmd_cache = make_command("cache",
+											"measure running a cached program",
+											"[iterations]",
+											NULL,
+											NULL, &main_bench_cache);
+
+CommandLine bench_cmd_builtin = make_command("builtin",
+											  "compare builtins and child processes",
+											  "[iterations]",
+											  NULL,
+											  NULL, &main_bench_builtin);
+
+CommandLine *bench_cmds[] = {
+	&bench_cmd_spawn,
+	&bench_cmd_template,
+	&bench_cmd_fds,
+	&bench_cmd_capture,
+	&bench_cmd_coprocess,
+	&bench_cmd_ring,
+	&bench_cmd_lines,
+	&bench_cmd_cache,
+	&bench_cmd_builtin,
+	NULL
+};
+
+CommandLine bench_cmd = make_command_set("bench", "run micro-benchmarks",
+										 NULL, NULL,
+										 NULL, bench_cmds);
+
 CommandLine *main_cmds[] = {
 	&env_cmd,
 	&path_cmd,
@@ -163,6 +334,15 @@ CommandLine *main_cmds[] = {
 	/* &cat_cmd, */
 	&which_cmd,
 	&echo_cmd,
+	&run_cmd,
+	&stream_cmd,
+	&batch_cmd,
+	&async_cmd,
+	&pipeline_cmd,
+	&cut_cmd,
+	&xargs_cmd,
+	&coproc_cmd,
+	&bench_cmd,
 	NULL
 };
 
@@ -679,8 +859,14 @@ main_which(int argc, char **argv)
 {
 	if (argc == 1)
 	{
-		Program prog = run_program("/usr/bin/which", argv[0], NULL);
-		int rc = prog.returnCode;
+		Program prog;
+		int rc;
+
+		/* no need to start a process for that */
+		register_default_builtins();
+
+		prog = run_program("which", argv[0], NULL);
+		rc = prog.returnCode;
 
 		if (prog.error != 0)
 		{
@@ -689,7 +875,7 @@ main_which(int argc, char **argv)
 			fflush(stderr);
 			exit(1);
 		}
-		fprintf(stdout, "main_which: %p %ld\n", prog.stdout, strlen(prog.stdout));
+		fprintf(stdout, "main_which: %p %zu\n", prog.stdout, prog.stdout_len);
 
 		if (prog.stdout != NULL)
 		{
@@ -734,32 +920,34 @@ main_echo12(int argc, char **argv)
 			exit(1);
 		}
 
+		register_default_builtins();
+
 		switch (nb)
 		{
 			case 1:
-				prog = run_program("/bin/echo", "1", NULL);
+				prog = run_program("echo", "1", NULL);
 				break;
 
 			case 2:
-				prog = run_program("/bin/echo", "1", "2", NULL);
+				prog = run_program("echo", "1", "2", NULL);
 				break;
 
 			case 12:
-				prog = run_program("/bin/echo",
+				prog = run_program("echo",
 								   "1", "2", "3", "4", "5", "6",
 								   "7", "8", "9", "a", "b", "c",
 								   NULL);
 				break;
 
 			case 13:
-				prog = run_program("/bin/echo",
+				prog = run_program("echo",
 								   "1", "2", "3", "4", "5", "6",
 								   "7", "8", "9", "a", "b", "c", "d",
 								   NULL);
 				break;
 
 			case 15:
-				prog = run_program("/bin/echo",
+				prog = run_program("echo",
 								   "1", "2", "3", "4", "5", "6",
 								   "7", "8", "9", "a", "b", "c", "d", "e", "f",
 								   NULL);
@@ -802,3 +990,1862 @@ main_echo12(int argc, char **argv)
 
 	return;
 }
+
+
+/*
+ * foo run
+ *
+ * Run any program given with its full path and arguments, and then display
+ * its captured output, stdout first and then stderr.
+ */
+static int
+run_getopt(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"setsid", no_argument, NULL, 's'},
+		{"posix-spawn", no_argument, NULL, 'P'},
+		{"timeout", required_argument, NULL, 't'},
+		{"memory-limit", required_argument, NULL, 'm'},
+		{"stdout-tail", required_argument, NULL, 'O'},
+		{"stderr-tail", required_argument, NULL, 'E'},
+		{"buffer", required_argument, NULL, 'b'},
+		{"output", required_argument, NULL, 'o'},
+		{"preview", required_argument, NULL, 'p'},
+		{"input", required_argument, NULL, 'i'},
+		{"stdin", no_argument, NULL, 'I'},
+		{"usage", no_argument, NULL, 'u'},
+		{"io-uring", no_argument, NULL, 'U'},
+		{"records", no_argument, NULL, 'r'},
+		{"builtins", no_argument, NULL, 'B'},
+		{"cache", required_argument, NULL, 'c'},
+		{"depends", required_argument, NULL, 'd'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int c, option_index, errors = 0;
+
+	optind = 0;
+
+	/* stop at the first non-option, that's the program to run */
+	while ((c = getopt_long(argc, argv, "+sPt:m:O:E:b:o:p:i:IuUrBc:d:",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 's':
+				run_opt_setsid = true;
+				break;
+
+			case 'P':
+				run_opt_posix_spawn = true;
+				break;
+
+			case 't':
+				if ((run_opt_timeout = atoi(optarg)) <= 0)
+				{
+					fprintf(stderr, "Failed to parse timeout \"%s\"\n", optarg);
+					errors++;
+				}
+				break;
+
+			case 'm':
+				if ((run_opt_memory_limit = strtoul(optarg, NULL, 10)) == 0)
+				{
+					fprintf(stderr,
+							"Failed to parse memory limit \"%s\"\n", optarg);
+					errors++;
+				}
+				break;
+
+			case 'O':
+				if ((run_opt_stdout_tail = strtoul(optarg, NULL, 10)) == 0)
+				{
+					fprintf(stderr,
+							"Failed to parse stdout tail \"%s\"\n", optarg);
+					errors++;
+				}
+				break;
+
+			case 'E':
+				if ((run_opt_stderr_tail = strtoul(optarg, NULL, 10)) == 0)
+				{
+					fprintf(stderr,
+							"Failed to parse stderr tail \"%s\"\n", optarg);
+					errors++;
+				}
+				break;
+
+			case 'b':
+				if ((run_opt_buffer = strtoul(optarg, NULL, 10)) == 0)
+				{
+					fprintf(stderr, "Failed to parse buffer \"%s\"\n", optarg);
+					errors++;
+				}
+				break;
+
+			case 'o':
+				run_opt_output = optarg;
+				break;
+
+			case 'p':
+				if ((run_opt_preview = strtoul(optarg, NULL, 10)) == 0)
+				{
+					fprintf(stderr, "Failed to parse preview \"%s\"\n", optarg);
+					errors++;
+				}
+				break;
+
+			case 'i':
+				run_opt_input = optarg;
+				break;
+
+			case 'I':
+				run_opt_stdin = true;
+				break;
+
+			case 'u':
+				run_opt_usage = true;
+				break;
+
+			case 'U':
+				run_opt_io_uring = true;
+				break;
+
+			case 'r':
+				run_opt_records = true;
+				break;
+
+			case 'B':
+				run_opt_builtins = true;
+				break;
+
+			case 'c':
+				run_opt_cache = optarg;
+				break;
+
+			case 'd':
+				/* keep room for the terminating NULL */
+				if (run_opt_depends_count == 15)
+				{
+					fprintf(stderr, "Too many dependencies\n");
+					errors++;
+					break;
+				}
+				run_opt_depends[run_opt_depends_count++] = optarg;
+				break;
+
+			default:
+			{
+				fprintf(stderr, "Unknown option \"%c\"\n", c);
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+	return optind;
+}
+
+
+static void
+main_run(int argc, char **argv)
+{
+	if (argc >= 1)
+	{
+		Program prog;
+		PQExpBufferData input;
+		int rc;
+
+		if (run_opt_builtins)
+		{
+			register_default_builtins();
+		}
+
+		prog = initialize_program(argv, run_opt_setsid);
+
+		prog.timeoutMs = run_opt_timeout;
+		prog.spawnMethod = run_opt_posix_spawn
+			? PROGRAM_SPAWN_POSIX_SPAWN
+			: PROGRAM_SPAWN_FORK;
+		prog.readMethod = run_opt_io_uring
+			? PROGRAM_READ_IO_URING
+			: PROGRAM_READ_POLL;
+		prog.memoryLimit = run_opt_memory_limit;
+		prog.stdoutTail = run_opt_stdout_tail;
+		prog.stderrTail = run_opt_stderr_tail;
+
+		if (run_opt_buffer > 0)
+		{
+			prog.stdoutBuffer = (char *) malloc(run_opt_buffer);
+			prog.stdoutBufferSize = run_opt_buffer;
+			prog.stderrBuffer = (char *) malloc(run_opt_buffer);
+			prog.stderrBufferSize = run_opt_buffer;
+		}
+		prog.previewSize = run_opt_preview;
+		prog.recordOutput = run_opt_records;
+		prog.recordLimit = run_opt_memory_limit;
+
+		if (run_opt_cache != NULL)
+		{
+			if (!open_program_cache(run_opt_cache))
+			{
+				fprintf(stderr, "Failed to open cache \"%s\": %s\n",
+						run_opt_cache, strerror(errno));
+				exit(1);
+			}
+			prog.cacheResult = true;
+			prog.cacheDeps = run_opt_depends;
+		}
+
+		if (run_opt_output != NULL)
+		{
+			prog.stdoutFd = open(run_opt_output,
+								 O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+			if (prog.stdoutFd == -1)
+			{
+				fprintf(stderr, "Failed to open \"%s\": %s\n",
+						run_opt_output, strerror(errno));
+				exit(1);
+			}
+		}
+
+		if (run_opt_input != NULL)
+		{
+			prog.stdinFd = open(run_opt_input, O_RDONLY);
+
+			if (prog.stdinFd == -1)
+			{
+				fprintf(stderr, "Failed to open \"%s\": %s\n",
+						run_opt_input, strerror(errno));
+				exit(1);
+			}
+		}
+
+		/* read all of our stdin in memory, and feed it to the program */
+		initPQExpBuffer(&input);
+
+		if (run_opt_stdin)
+		{
+			char chunk[BUFSIZE];
+			size_t bytes;
+
+			while ((bytes = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+			{
+				appendBinaryPQExpBuffer(&input, chunk, bytes);
+			}
+
+			prog.stdinData = input.data;
+			prog.stdinLen = input.len;
+		}
+
+		execute_program(&prog);
+		rc = prog.returnCode;
+
+		termPQExpBuffer(&input);
+
+		if (prog.stdinFd != -1)
+		{
+			close(prog.stdinFd);
+		}
+
+		if (prog.stdoutFd != -1)
+		{
+			close(prog.stdoutFd);
+		}
+
+		if (prog.error != 0)
+		{
+			fprintf(stderr, "Failed to run program \"%s\": %s\n",
+					prog.program, strerror(prog.error));
+			fflush(stderr);
+			exit(1);
+		}
+
+		if (run_opt_records)
+		{
+			print_program_records(stdout, &prog);
+		}
+
+		/* output may be binary, don't stop at NUL bytes */
+		if (prog.stdout != NULL)
+		{
+			fwrite(prog.stdout, 1, prog.stdout_len, stdout);
+		}
+
+		if (prog.stderr != NULL)
+		{
+			fwrite(prog.stderr, 1, prog.stderr_len, stderr);
+		}
+
+		if (prog.timedOut)
+		{
+			fprintf(stderr, "Program \"%s\" timed out after %.0f ms\n",
+					prog.program, prog.elapsedMs);
+
+			/* same exit code as timeout(1) */
+			rc = 124;
+		}
+
+		if (run_opt_usage)
+		{
+			print_program_usage(stderr, &prog);
+		}
+
+		if (prog.outputTruncated && !run_opt_records)
+		{
+			fprintf(stderr, "(output truncated)\n");
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+
+		free_program(&prog);
+		reset_program_cache();
+
+		free(prog.stdoutBuffer);
+		free(prog.stderrBuffer);
+		reset_program_builtins();
+
+		exit(rc);
+	}
+	else
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	return;
+}
+
+
+/*
+ * Display the resources used by a program that ran, so that we can see which
+ * commands are costly.
+ */
+static void
+print_program_usage(FILE *stream, Program *prog)
+{
+	if (prog->cacheHit)
+	{
+		fprintf(stream, "result from the cache\n");
+		return;
+	}
+
+	if (prog->ranBuiltin)
+	{
+		fprintf(stream, "builtin, wall %.3f ms, stdout %llu bytes, stderr %llu bytes\n",
+				prog->elapsedMs,
+				(unsigned long long) prog->stdoutBytes,
+				(unsigned long long) prog->stderrBytes);
+		return;
+	}
+
+	fprintf(stream,
+			"wall %.1f ms, user %.1f ms, sys %.1f ms, max rss %ld kB, "
+			"switches %ld voluntary %ld involuntary, "
+			"stdout %llu bytes, stderr %llu bytes\n",
+			prog->elapsedMs, prog->userMs, prog->systemMs, prog->maxRssKB,
+			prog->voluntarySwitches, prog->involuntarySwitches,
+			(unsigned long long) prog->stdoutBytes,
+			(unsigned long long) prog->stderrBytes);
+}
+
+/*
+ * Display the output of a program that ran with recordOutput, stdout and
+ * stderr interleaved in the order we read them, each line prefixed with the
+ * time in milliseconds since the program started and the stream name.
+ */
+static void
+print_program_records(FILE *stream, Program *prog)
+{
+	ProgramRecordIterator iter;
+
+	init_record_iterator(&iter, prog);
+
+	while (record_iterator_next(&iter))
+	{
+		const char *name = iter.stream == STDOUT_FILENO ? "out" : "err";
+		const char *line = iter.data;
+		const char *end = iter.data + iter.len;
+
+		while (line < end)
+		{
+			const char *eol = memchr(line, '\n', end - line);
+			size_t len = eol == NULL ? (size_t) (end - line) : eol - line;
+
+			fprintf(stream, "%10.3f %s | ", iter.usecs / 1000.0, name);
+			fwrite(line, 1, len, stream);
+			fputc('\n', stream);
+
+			line += len + 1;
+		}
+	}
+
+	if (prog->outputTruncated)
+	{
+		fprintf(stream, "(output truncated at %zu bytes)\n", prog->output_len);
+	}
+}
+
+/*
+ * foo stream
+ *
+ * Run any program given with its full path and arguments, and copy its output
+ * to our own stdout and stderr as soon as we read it, without keeping it in
+ * memory. At the end, display how many bytes went through.
+ */
+typedef struct
+{
+	size_t stdoutBytes;
+	size_t stderrBytes;
+} StreamCounters;
+
+
+static void
+stream_stdout_hook(Program *prog, const char *data, size_t len)
+{
+	StreamCounters *counters = (StreamCounters *) prog->context;
+
+	counters->stdoutBytes += len;
+	fwrite(data, 1, len, stdout);
+	fflush(stdout);
+}
+
+
+static void
+stream_stderr_hook(Program *prog, const char *data, size_t len)
+{
+	StreamCounters *counters = (StreamCounters *) prog->context;
+
+	counters->stderrBytes += len;
+	fwrite(data, 1, len, stderr);
+	fflush(stderr);
+}
+
+
+static void
+main_stream(int argc, char **argv)
+{
+	if (argc >= 1)
+	{
+		Program prog = initialize_program(argv, false);
+		StreamCounters counters = { 0, 0 };
+
+		prog.capture = false;
+		prog.stdoutHook = &stream_stdout_hook;
+		prog.stderrHook = &stream_stderr_hook;
+		prog.context = &counters;
+
+		execute_program(&prog);
+
+		if (prog.error != 0)
+		{
+			fprintf(stderr, "Failed to run program \"%s\": %s\n",
+					prog.program, strerror(prog.error));
+			fflush(stderr);
+			exit(1);
+		}
+
+		fprintf(stderr, "streamed %zu bytes of stdout, %zu bytes of stderr\n",
+				counters.stdoutBytes, counters.stderrBytes);
+		fflush(stderr);
+
+		free_program(&prog);
+
+		exit(prog.returnCode);
+	}
+	else
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	return;
+}
+
+/*
+ * foo batch
+ *
+ * Run several programs at once, each given as a single command line string
+ * where arguments are separated by spaces, and display their output in the
+ * order in which they complete.
+ */
+static void
+main_batch(int argc, char **argv)
+{
+	int parallel, count = argc - 1;
+	Program *programs;
+	int *completed;
+	int rc = 0;
+	struct timespec start, end;
+
+	if (argc < 2)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if ((parallel = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse parallel \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	programs = (Program *) malloc(count * sizeof(Program));
+	completed = (int *) malloc(count * sizeof(int));
+
+	for (int i = 0; i < count; i++)
+	{
+		programs[i] = initialize_command_line(argv[i + 1], i + 1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	execute_programs(programs, count, parallel, completed);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (int i = 0; i < count; i++)
+	{
+		Program *prog = &programs[completed[i]];
+
+		if (prog->error != 0)
+		{
+			fprintf(stdout, "[%d] %s: %s\n",
+					completed[i], prog->program, strerror(prog->error));
+			rc = 1;
+		}
+		else
+		{
+			fprintf(stdout, "[%d] %s: exit code %d\n",
+					completed[i], prog->program, prog->returnCode);
+			print_program_usage(stdout, prog);
+		}
+
+		if (prog->stdout != NULL)
+		{
+			fwrite(prog->stdout, 1, prog->stdout_len, stdout);
+		}
+
+		if (prog->stderr != NULL)
+		{
+			fwrite(prog->stderr, 1, prog->stderr_len, stdout);
+		}
+
+		free_program(prog);
+	}
+
+	fprintf(stdout, "%d programs done in %.0f ms\n",
+			count, elapsed_usecs(&start, &end) / 1000);
+	fflush(stdout);
+
+	free(programs);
+	free(completed);
+
+	exit(rc);
+}
+
+/*
+ * Prepare a Program from a command line where arguments are separated by
+ * spaces, exiting when the command line is empty.
+ */
+static Program
+initialize_command_line(const char *line, int position)
+{
+	char *copy = strdup(line);
+	char *args[ARGS_INCREMENT * 4] = { NULL };
+	int nbArgs = 0;
+	Program prog;
+
+	for (char *arg = strtok(copy, " ");
+		 arg != NULL && nbArgs < ARGS_INCREMENT * 4 - 1;
+		 arg = strtok(NULL, " "))
+	{
+		args[nbArgs++] = arg;
+	}
+
+	if (nbArgs == 0)
+	{
+		fprintf(stderr, "Empty command line at position %d\n", position);
+		exit(1);
+	}
+
+	prog = initialize_program(args, false);
+	free(copy);
+
+	return prog;
+}
+
+/*
+ * foo async
+ *
+ * Run all the given command lines at once, supervising them from a single
+ * epoll loop with the asynchronous runprogram.h API, as a daemon with its own
+ * event loop would do.
+ */
+static void
+main_async(int argc, char **argv)
+{
+	int count = argc, nbRunning = 0;
+	Program *programs;
+	struct pollfd *fds;
+	bool *running;
+	int epfd, rc = 0;
+
+	if (argc < 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	programs = (Program *) malloc(count * sizeof(Program));
+	fds = (struct pollfd *) malloc(count * PROGRAM_POLLFDS
+								   * sizeof(struct pollfd));
+	running = (bool *) malloc(count * sizeof(bool));
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		fprintf(stderr, "Failed to create epoll instance: %s\n",
+				strerror(errno));
+		exit(1);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		struct pollfd none[PROGRAM_POLLFDS];
+
+		programs[i] = initialize_command_line(argv[i], i + 1);
+		running[i] = program_start(&programs[i], fds + i * PROGRAM_POLLFDS);
+
+		if (!running[i])
+		{
+			fprintf(stdout, "[%d] %s: %s\n",
+					i, programs[i].program, strerror(programs[i].error));
+			free_program(&programs[i]);
+			rc = 1;
+			continue;
+		}
+
+		for (int f = 0; f < PROGRAM_POLLFDS; f++)
+		{
+			none[f].fd = -1;
+		}
+		async_update_epoll(epfd, i, none, fds + i * PROGRAM_POLLFDS);
+		nbRunning++;
+	}
+
+	while (nbRunning > 0)
+	{
+		struct epoll_event events[64];
+		int timeout = -1, nbEvents;
+
+		for (int i = 0; i < count; i++)
+		{
+			int progTimeout;
+
+			if (!running[i])
+			{
+				continue;
+			}
+
+			progTimeout = program_next_timeout(&programs[i]);
+
+			if (progTimeout >= 0 && (timeout == -1 || progTimeout < timeout))
+			{
+				timeout = progTimeout;
+			}
+		}
+
+		nbEvents = epoll_wait(epfd, events, 64, timeout);
+
+		if (nbEvents == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "Failed to wait for events: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+
+		/* the event data is the index of the slot in our fds array */
+		for (int e = 0; e < nbEvents; e++)
+		{
+			fds[events[e].data.u32].revents =
+				((events[e].events & EPOLLIN) ? POLLIN : 0)
+				| ((events[e].events & EPOLLOUT) ? POLLOUT : 0)
+				| ((events[e].events & EPOLLHUP) ? POLLHUP : 0)
+				| ((events[e].events & EPOLLERR) ? POLLERR : 0);
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			struct pollfd before[PROGRAM_POLLFDS];
+			struct pollfd *progFds = fds + i * PROGRAM_POLLFDS;
+			Program *prog = &programs[i];
+			bool done;
+
+			if (!running[i])
+			{
+				continue;
+			}
+
+			memcpy(before, progFds, sizeof(before));
+			done = program_on_readable(prog, progFds);
+
+			if (done)
+			{
+				for (int f = 0; f < PROGRAM_POLLFDS; f++)
+				{
+					progFds[f].fd = -1;
+				}
+			}
+			async_update_epoll(epfd, i, before, progFds);
+
+			if (!done)
+			{
+				continue;
+			}
+
+			program_finish(prog);
+			running[i] = false;
+			nbRunning--;
+
+			fprintf(stdout, "[%d] %s: exit code %d\n",
+					i, prog->program, prog->returnCode);
+
+			if (prog->stdout != NULL)
+			{
+				fwrite(prog->stdout, 1, prog->stdout_len, stdout);
+			}
+
+			if (prog->stderr != NULL)
+			{
+				fwrite(prog->stderr, 1, prog->stderr_len, stdout);
+			}
+			fflush(stdout);
+
+			free_program(prog);
+		}
+	}
+
+	close(epfd);
+	free(programs);
+	free(fds);
+	free(running);
+
+	exit(rc);
+}
+
+/*
+ * Register the program descriptors that appeared in the epoll instance, and
+ * remove those that went away. The epoll data is the index of the slot in
+ * the fds array of main_async().
+ */
+static void
+async_update_epoll(int epfd, int index,
+				   struct pollfd *before, struct pollfd *after)
+{
+	for (int f = 0; f < PROGRAM_POLLFDS; f++)
+	{
+		if (before[f].fd != -1 && before[f].fd != after[f].fd)
+		{
+			(void) epoll_ctl(epfd, EPOLL_CTL_DEL, before[f].fd, NULL);
+		}
+
+		if (after[f].fd != -1 && before[f].fd != after[f].fd)
+		{
+			struct epoll_event event = { 0 };
+
+			event.events = (after[f].events & POLLIN) ? EPOLLIN : EPOLLOUT;
+			event.data.u32 = index * PROGRAM_POLLFDS + f;
+
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, after[f].fd, &event) == -1)
+			{
+				fprintf(stderr, "Failed to watch fd %d: %s\n",
+						after[f].fd, strerror(errno));
+				exit(1);
+			}
+		}
+	}
+}
+
+/*
+ * foo pipeline
+ *
+ * Run the programs separated with "|" arguments as a pipeline, without a
+ * shell, then display the last program output, the errors of all of them,
+ * and their exit codes. We exit with the last program exit code, as the
+ * shell does.
+ */
+static void
+main_pipeline(int argc, char **argv)
+{
+	Program *stages;
+	int count = 1, start = 0, rc;
+
+	if (argc < 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "|") == 0)
+		{
+			count++;
+		}
+	}
+
+	stages = (Program *) malloc(count * sizeof(Program));
+
+	for (int stage = 0; stage < count; stage++)
+	{
+		int end = start;
+
+		while (end < argc && strcmp(argv[end], "|") != 0)
+		{
+			end++;
+		}
+
+		if (end == start)
+		{
+			fprintf(stderr, "Empty program at position %d\n", stage + 1);
+			exit(1);
+		}
+
+		/* initialize_program() stops at the NULL, the "|" is ours */
+		argv[end < argc ? end : argc] = NULL;
+		stages[stage] = initialize_program(argv + start, false);
+
+		start = end + 1;
+	}
+
+	execute_pipeline(stages, count);
+
+	for (int stage = 0; stage < count; stage++)
+	{
+		Program *prog = &stages[stage];
+
+		if (prog->stderr != NULL)
+		{
+			fwrite(prog->stderr, 1, prog->stderr_len, stderr);
+		}
+
+		if (prog->error != 0)
+		{
+			fprintf(stderr, "[%d] %s: %s\n",
+					stage, prog->program, strerror(prog->error));
+		}
+		else
+		{
+			fprintf(stderr, "[%d] %s: exit code %d\n",
+					stage, prog->program, prog->returnCode);
+		}
+	}
+
+	if (stages[count - 1].stdout != NULL)
+	{
+		fwrite(stages[count - 1].stdout, 1, stages[count - 1].stdout_len,
+			   stdout);
+	}
+
+	rc = stages[count - 1].error != 0 ? 1 : stages[count - 1].returnCode;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int stage = 0; stage < count; stage++)
+	{
+		free_program(&stages[stage]);
+	}
+	free(stages);
+
+	exit(rc);
+}
+
+/*
+ * foo cut
+ *
+ * Run a program, and display the given field of each line of its output, as
+ * cut -d <delimiter> -f <field> does, fields being numbered from 1.
+ */
+static void
+main_cut(int argc, char **argv)
+{
+	Program prog;
+	ProgramLineIterator lines;
+	int field, rc;
+
+	if (argc < 3 || strlen(argv[0]) != 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if ((field = atoi(argv[1])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse field \"%s\"\n", argv[1]);
+		exit(1);
+	}
+
+	prog = initialize_program(argv + 2, false);
+	execute_program(&prog);
+
+	if (prog.error != 0)
+	{
+		fprintf(stderr, "Failed to run program \"%s\": %s\n",
+				prog.program, strerror(prog.error));
+		exit(1);
+	}
+
+	init_line_iterator(&lines, prog.stdout, prog.stdout_len);
+
+	while (line_iterator_next(&lines))
+	{
+		ProgramFieldIterator fields;
+		int n = 0;
+
+		init_field_iterator(&fields, lines.line, lines.len, argv[0][0]);
+
+		while (field_iterator_next(&fields) && ++n < field);
+
+		/* as cut(1), lines without the delimiter are displayed as-is */
+		if (n == field)
+		{
+			fwrite(fields.field, 1, fields.len, stdout);
+		}
+		else if (n == 1)
+		{
+			fwrite(lines.line, 1, lines.len, stdout);
+		}
+		fputc('\n', stdout);
+	}
+
+	if (prog.stderr != NULL)
+	{
+		fwrite(prog.stderr, 1, prog.stderr_len, stderr);
+	}
+
+	rc = prog.returnCode;
+	free_program(&prog);
+
+	exit(rc);
+}
+
+/*
+ * foo xargs
+ *
+ * Read arguments from stdin, one per line, and run the program with as many
+ * of them as fit on a command line, as xargs -d '\\n' does.
+ */
+static void
+main_xargs(int argc, char **argv)
+{
+	Program prog;
+	PQExpBufferData input;
+	ProgramLineIterator lines;
+	char **args = NULL;
+	int parallel, count = 0, size = 0, batches, rc;
+	char chunk[BUFSIZE];
+	size_t bytes;
+
+	if (argc < 2)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if ((parallel = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse parallel \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	initPQExpBuffer(&input);
+
+	while ((bytes = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+	{
+		appendBinaryPQExpBuffer(&input, chunk, bytes);
+	}
+
+	/* the arguments point into input, where we replace newlines with NUL */
+	init_line_iterator(&lines, input.data, input.len);
+
+	while (line_iterator_next(&lines))
+	{
+		if (count == size)
+		{
+			size = size == 0 ? 1024 : size * 2;
+			args = (char **) realloc(args, size * sizeof(char *));
+		}
+		args[count] = input.data + (lines.line - input.data);
+		args[count][lines.len] = '\0';
+		count++;
+	}
+
+	prog = initialize_program(argv + 1, false);
+	batches = execute_batched_program(&prog, args, count, parallel);
+
+	if (prog.error != 0)
+	{
+		fprintf(stderr, "Failed to run program \"%s\": %s\n",
+				prog.program, strerror(prog.error));
+		exit(1);
+	}
+
+	if (prog.stdout != NULL)
+	{
+		fwrite(prog.stdout, 1, prog.stdout_len, stdout);
+	}
+
+	if (prog.stderr != NULL)
+	{
+		fwrite(prog.stderr, 1, prog.stderr_len, stderr);
+	}
+
+	fprintf(stderr, "%d arguments in %d batches, %.1f ms\n",
+			count, batches, prog.elapsedMs);
+
+	rc = prog.returnCode;
+
+	free_program(&prog);
+	free(args);
+	termPQExpBuffer(&input);
+
+	exit(rc);
+}
+
+/*
+ * foo coproc
+ *
+ * Start the given program as a co-process, then send it each line we read
+ * from stdin and display its one line responses. When the co-process dies,
+ * the request is sent again once to a new one.
+ */
+static void
+main_coproc(int argc, char **argv)
+{
+	Coprocess *cop;
+	char line[BUFSIZE];
+
+	if (argc < 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if ((cop = start_coprocess(argv, COPROCESS_FRAME_LINE)) == NULL)
+	{
+		fprintf(stderr, "Failed to start co-process \"%s\": %s\n",
+				argv[0], strerror(errno));
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), stdin) != NULL)
+	{
+		const char *response;
+		size_t len;
+
+		if (!call_coprocess(cop, line, strlen(line), &response, &len)
+			&& !call_coprocess(cop, line, strlen(line), &response, &len))
+		{
+			fprintf(stderr, "Failed to call co-process \"%s\": %s\n",
+					cop->prog.program, strerror(cop->prog.error));
+			stop_coprocess(cop);
+			exit(1);
+		}
+
+		fprintf(stdout, "%s\n", response);
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "co-process restarted %d times\n", cop->restarts);
+
+	stop_coprocess(cop);
+
+	return;
+}
+
+/*
+ * foo bench
+ *
+ * Micro-benchmarks for the runprogram.h API. Timings are taken with the
+ * monotonic clock and reported in microseconds per operation.
+ */
+static double
+elapsed_usecs(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6
+		+ (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+
+/*
+ * Spawn /bin/true many times with each spawn method, while the parent process
+ * holds an increasing amount of touched heap memory: fork() has to copy the
+ * page tables for all of it, posix_spawn() does not.
+ */
+static double
+bench_spawn_method(ProgramSpawnMethod method, bool inheritFds, int iterations)
+{
+	char *args[] = { "/bin/true", NULL };
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Program prog = initialize_program(args, false);
+
+		prog.spawnMethod = method;
+		prog.inheritFds = inheritFds;
+		execute_program(&prog);
+
+		if (prog.error != 0)
+		{
+			fprintf(stderr, "Failed to run program \"%s\": %s\n",
+					prog.program, strerror(prog.error));
+			exit(1);
+		}
+		free_program(&prog);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return elapsed_usecs(&start, &end) / iterations;
+}
+
+
+static void
+main_bench_spawn(int argc, char **argv)
+{
+	int iterations = 100;
+	size_t heapSizesMB[] = { 0, 16, 128, 512 };
+	int nbHeapSizes = sizeof(heapSizesMB) / sizeof(heapSizesMB[0]);
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (iterations = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse iterations \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	fprintf(stdout, "%8s  %12s  %12s\n", "heap MB", "fork us", "spawn us");
+
+	for (int i = 0; i < nbHeapSizes; i++)
+	{
+		size_t size = heapSizesMB[i] * 1024 * 1024;
+		char *heap = NULL;
+		double forkUsecs, spawnUsecs;
+
+		if (size > 0)
+		{
+			if ((heap = malloc(size)) == NULL)
+			{
+				fprintf(stderr, "Failed to allocate %zu MB\n", heapSizesMB[i]);
+				exit(1);
+			}
+			/* touch the pages so that they are mapped in the parent */
+			memset(heap, 'x', size);
+		}
+
+		forkUsecs = bench_spawn_method(PROGRAM_SPAWN_FORK, false, iterations);
+		spawnUsecs =
+			bench_spawn_method(PROGRAM_SPAWN_POSIX_SPAWN, false, iterations);
+
+		fprintf(stdout, "%8zu  %12.1f  %12.1f\n",
+				heapSizesMB[i], forkUsecs, spawnUsecs);
+		fflush(stdout);
+
+		free(heap);
+	}
+	return;
+}
+
+
+/*
+ * Spawn /bin/true with each spawn method, first with only the standard
+ * streams open, then with many more open descriptors, such as a server would
+ * have with its client sockets. Compare keeping them open in the child with
+ * closing them, which costs a close_range() call or a scan of /proc/self/fd.
+ */
+static void
+main_bench_fds(int argc, char **argv)
+{
+	int count = 10000;
+	int iterations = 200;
+	int counts[2];
+	struct rlimit limit;
+	int *fds;
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (count = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse count \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	/* make room for that many descriptors */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+		limit.rlim_cur < (rlim_t) count + 64)
+	{
+		limit.rlim_cur = limit.rlim_max == RLIM_INFINITY
+			? (rlim_t) count + 64
+			: limit.rlim_max;
+
+		if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+		{
+			fprintf(stderr, "Failed to raise the open files limit: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+	}
+
+	fds = (int *) malloc(count * sizeof(int));
+	counts[0] = 0;
+	counts[1] = count;
+
+	fprintf(stdout, "%8s  %12s  %12s  %12s  %12s\n",
+			"open fds", "fork us", "fork+close", "spawn us", "spawn+close");
+
+	for (int c = 0; c < 2; c++)
+	{
+		double forkUsecs, forkCloseUsecs, spawnUsecs, spawnCloseUsecs;
+
+		for (int i = 0; i < counts[c]; i++)
+		{
+			if ((fds[i] = open(DEV_NULL, O_RDONLY)) == -1)
+			{
+				fprintf(stderr, "Failed to open %d descriptors: %s\n",
+						counts[c], strerror(errno));
+				exit(1);
+			}
+		}
+
+		forkUsecs = bench_spawn_method(PROGRAM_SPAWN_FORK, true, iterations);
+		forkCloseUsecs =
+			bench_spawn_method(PROGRAM_SPAWN_FORK, false, iterations);
+		spawnUsecs =
+			bench_spawn_method(PROGRAM_SPAWN_POSIX_SPAWN, true, iterations);
+		spawnCloseUsecs =
+			bench_spawn_method(PROGRAM_SPAWN_POSIX_SPAWN, false, iterations);
+
+		fprintf(stdout, "%8d  %12.1f  %12.1f  %12.1f  %12.1f\n",
+				counts[c], forkUsecs, forkCloseUsecs,
+				spawnUsecs, spawnCloseUsecs);
+		fflush(stdout);
+
+		for (int i = 0; i < counts[c]; i++)
+		{
+			close(fds[i]);
+		}
+	}
+
+	free(fds);
+
+	return;
+}
+
+
+/*
+ * Run /bin/echo with a different argument each time, first building the
+ * Program from scratch with initialize_program(), then from a compiled
+ * command template, and check that both give the expected output.
+ */
+static void
+main_bench_template(int argc, char **argv)
+{
+	int iterations = 1000;
+	char value[32];
+	char *values[] = { value };
+	char *args[] = { "/bin/echo", "-n", value, NULL };
+	char *tmplArgs[] = { "/bin/echo", "-n", COMMAND_SLOT, NULL };
+	CommandTemplate *cmd;
+	struct timespec start, end;
+	double programUsecs, templateUsecs, buffersUsecs;
+	char outbuf[64], errbuf[64];
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (iterations = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse iterations \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	if ((cmd = compile_command(tmplArgs)) == NULL)
+	{
+		fprintf(stderr, "Failed to compile command \"%s\": %s\n",
+				tmplArgs[0], strerror(errno));
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Program prog;
+
+		sprintf(value, "%d", i);
+		prog = initialize_program(args, false);
+		execute_program(&prog);
+
+		if (prog.returnCode != 0 || strcmp(prog.stdout, value) != 0)
+		{
+			fprintf(stderr, "Unexpected output from \"%s\"\n", prog.program);
+			exit(1);
+		}
+		free_program(&prog);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	programUsecs = elapsed_usecs(&start, &end) / iterations;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Program prog;
+
+		sprintf(value, "%d", i);
+		prog = run_command(cmd, values);
+
+		if (prog.returnCode != 0 || strcmp(prog.stdout, value) != 0)
+		{
+			fprintf(stderr, "Unexpected output from command template\n");
+			exit(1);
+		}
+		free_program(&prog);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	templateUsecs = elapsed_usecs(&start, &end) / iterations;
+
+	/* capture in our buffers, the loop then doesn't allocate memory */
+	cmd->prog.stdoutBuffer = outbuf;
+	cmd->prog.stdoutBufferSize = sizeof(outbuf);
+	cmd->prog.stderrBuffer = errbuf;
+	cmd->prog.stderrBufferSize = sizeof(errbuf);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Program prog;
+
+		sprintf(value, "%d", i);
+		prog = run_command(cmd, values);
+
+		if (prog.returnCode != 0 || strcmp(outbuf, value) != 0)
+		{
+			fprintf(stderr, "Unexpected output from command template\n");
+			exit(1);
+		}
+		free_program(&prog);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	buffersUsecs = elapsed_usecs(&start, &end) / iterations;
+
+	free_command(cmd);
+
+	fprintf(stdout, "%12s  %12s  %12s\n",
+			"program us", "template us", "buffers us");
+	fprintf(stdout, "%12.1f  %12.1f  %12.1f\n",
+			programUsecs, templateUsecs, buffersUsecs);
+
+	return;
+}
+
+
+/*
+ * Read a lot of data from a fast producer, with the historical fixed 1kB
+ * reads and kernel default pipe size, and then with adaptive read and pipe
+ * sizes, both when capturing the output and when streaming it.
+ */
+static void
+main_bench_capture(int argc, char **argv)
+{
+	int megabytes = 256;
+	char count[32];
+	char *args[] = { "/usr/bin/head", "-c", count, "/dev/zero", NULL };
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (megabytes = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse megabytes \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	snprintf(count, sizeof(count), "%dM", megabytes);
+
+	fprintf(stdout, "%10s  %8s  %12s  %10s\n",
+			"reads", "capture", "read calls", "MB/s");
+
+	for (int i = 0; i < 4; i++)
+	{
+		bool adaptive = i % 2 == 1;
+		bool capture = i < 2;
+		Program prog = initialize_program(args, false);
+
+		prog.capture = capture;
+
+		if (!adaptive)
+		{
+			prog.readSize = BUFSIZE;
+			prog.pipeSize = 0;
+		}
+
+		execute_program(&prog);
+
+		if (prog.error != 0)
+		{
+			fprintf(stderr, "Failed to run program \"%s\": %s\n",
+					prog.program, strerror(prog.error));
+			exit(1);
+		}
+
+		fprintf(stdout, "%10s  %8s  %12llu  %10.1f\n",
+				adaptive ? "adaptive" : "fixed",
+				capture ? "yes" : "no",
+				(unsigned long long) prog.readCalls,
+				program_read_throughput(&prog));
+		fflush(stdout);
+
+		free_program(&prog);
+	}
+	return;
+}
+
+
+/*
+ * Compare the latency of a round-trip to a /bin/cat co-process with the
+ * latency of running /bin/echo once per call.
+ */
+static void
+main_bench_coprocess(int argc, char **argv)
+{
+	int iterations = 1000;
+	char *args[] = { "/bin/cat", NULL };
+	Coprocess *cop;
+	struct timespec start, end;
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (iterations = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse iterations \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	if ((cop = start_coprocess(args, COPROCESS_FRAME_LINE)) == NULL)
+	{
+		fprintf(stderr, "Failed to start co-process: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		const char *response;
+		size_t len;
+
+		if (!call_coprocess(cop, "ping", 4, &response, &len)
+			|| strcmp(response, "ping") != 0)
+		{
+			fprintf(stderr, "Failed to call co-process: %s\n",
+					strerror(cop->prog.error));
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stop_coprocess(cop);
+
+	fprintf(stdout, "%12s  %10.1f us/call\n",
+			"coprocess", elapsed_usecs(&start, &end) / iterations);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Program prog = run_program("echo", "ping", NULL);
+
+		free_program(&prog);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(stdout, "%12s  %10.1f us/call\n",
+			"run_program", elapsed_usecs(&start, &end) / iterations);
+	fflush(stdout);
+
+	return;
+}
+
+
+/*
+ * Compare the poll() and read() loop with io_uring, first for many small
+ * programs, then for a large output. We count the system calls used to read
+ * the pipes and to wait for them: read() and poll(), or io_uring_enter().
+ */
+static void
+main_bench_ring(int argc, char **argv)
+{
+	int megabytes = 256;
+	int iterations = 500;
+	char count[32];
+	char *echoArgs[] = { "/bin/echo", "hello", NULL };
+	char *headArgs[] = { "/usr/bin/head", "-c", count, "/dev/zero", NULL };
+	ProgramReadMethod methods[] = { PROGRAM_READ_POLL, PROGRAM_READ_IO_URING };
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (megabytes = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse megabytes \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	snprintf(count, sizeof(count), "%dM", megabytes);
+
+	if (!program_ring_available())
+	{
+		fprintf(stdout, "io_uring is not available, both use poll()\n");
+	}
+
+	fprintf(stdout, "%10s  %12s  %12s  %10s  %12s\n",
+			"method", "spawn us", "calls/spawn", "MB/s", "calls");
+
+	for (int m = 0; m < 2; m++)
+	{
+		uint64_t spawnCalls = 0;
+		struct timespec start, end;
+		Program prog;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (int i = 0; i < iterations; i++)
+		{
+			prog = initialize_program(echoArgs, false);
+			prog.readMethod = methods[m];
+
+			execute_program(&prog);
+
+			if (prog.error != 0)
+			{
+				fprintf(stderr, "Failed to run program \"%s\": %s\n",
+						prog.program, strerror(prog.error));
+				exit(1);
+			}
+			spawnCalls += prog.readCalls + prog.waitCalls;
+
+			free_program(&prog);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		prog = initialize_program(headArgs, false);
+		prog.readMethod = methods[m];
+		prog.capture = false;
+
+		execute_program(&prog);
+
+		if (prog.error != 0)
+		{
+			fprintf(stderr, "Failed to run program \"%s\": %s\n",
+					prog.program, strerror(prog.error));
+			exit(1);
+		}
+
+		fprintf(stdout, "%10s  %12.1f  %12.1f  %10.1f  %12llu\n",
+				methods[m] == PROGRAM_READ_POLL ? "poll" : "io_uring",
+				elapsed_usecs(&start, &end) / iterations,
+				(double) spawnCalls / iterations,
+				program_read_throughput(&prog),
+				(unsigned long long) (prog.readCalls + prog.waitCalls));
+		fflush(stdout);
+
+		free_program(&prog);
+	}
+	return;
+}
+
+
+/*
+ * Split a large output in lines, and then each line in fields, as a catalog
+ * dump would be parsed, and compare the throughput with a memcpy() of the
+ * same data, which is about what the memory bandwidth allows.
+ */
+static void
+main_bench_lines(int argc, char **argv)
+{
+	int megabytes = 256;
+	size_t size;
+	char *data, *copy;
+	uint64_t nbLines = 0, nbFields = 0, checksum = 0;
+	struct timespec start, end;
+	double memcpyUsecs, linesUsecs, fieldsUsecs;
+	ProgramLineIterator lines;
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (megabytes = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse megabytes \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	size = (size_t) megabytes * 1024 * 1024;
+	data = (char *) malloc(size);
+	copy = (char *) malloc(size);
+
+	if (data == NULL || copy == NULL)
+	{
+		fprintf(stderr, "Failed to allocate %d MB\n", megabytes);
+		exit(1);
+	}
+
+	/* lines of "oid|relname|namespace|owner|kind", of varying lengths */
+	for (size_t pos = 0, i = 0; pos < size; i++)
+	{
+		char line[128];
+		int len = snprintf(line, sizeof(line), "%zu|relation_%zu|public|%s|%c\n",
+						   16384 + i, i * 7919 % 100000,
+						   i % 3 == 0 ? "postgres" : "app", "rvi"[i % 3]);
+
+		memcpy(data + pos, line, (size_t) len < size - pos ? (size_t) len : size - pos);
+		pos += len;
+	}
+	data[size - 1] = '\n';
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	memcpy(copy, data, size);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	memcpyUsecs = elapsed_usecs(&start, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	init_line_iterator(&lines, data, size);
+
+	while (line_iterator_next(&lines))
+	{
+		nbLines++;
+		checksum += lines.len;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	linesUsecs = elapsed_usecs(&start, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	init_line_iterator(&lines, data, size);
+
+	while (line_iterator_next(&lines))
+	{
+		ProgramFieldIterator fields;
+
+		init_field_iterator(&fields, lines.line, lines.len, '|');
+
+		while (field_iterator_next(&fields))
+		{
+			nbFields++;
+			checksum += fields.len;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fieldsUsecs = elapsed_usecs(&start, &end);
+
+	fprintf(stdout, "%llu lines, %llu fields, checksum %llu\n",
+			(unsigned long long) nbLines, (unsigned long long) nbFields,
+			(unsigned long long) checksum);
+	fprintf(stdout, "%10s  %10s\n", "", "MB/s");
+	fprintf(stdout, "%10s  %10.1f\n", "memcpy", megabytes / (memcpyUsecs / 1e6));
+	fprintf(stdout, "%10s  %10.1f\n", "lines", megabytes / (linesUsecs / 1e6));
+	fprintf(stdout, "%10s  %10.1f\n", "fields", megabytes / (fieldsUsecs / 1e6));
+
+	free(data);
+	free(copy);
+
+	return;
+}
+
+
+/*
+ * Run the same program many times, first starting it each time, then with
+ * its result cached after the first run.
+ */
+static void
+main_bench_cache(int argc, char **argv)
+{
+	int iterations = 1000;
+	char *args[] = { "uname", "-r", NULL };
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (iterations = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse iterations \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	fprintf(stdout, "%10s  %12s  %8s\n", "", "us/run", "hits");
+
+	for (int cached = 0; cached < 2; cached++)
+	{
+		struct timespec start, end;
+		int hits = 0;
+
+		reset_program_cache();
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (int i = 0; i < iterations; i++)
+		{
+			Program prog = initialize_program(args, false);
+
+			prog.cacheResult = cached == 1;
+
+			execute_program(&prog);
+
+			if (prog.error != 0 || prog.returnCode != 0)
+			{
+				fprintf(stderr, "Failed to run program \"%s\": %s\n",
+						prog.program, strerror(prog.error));
+				exit(1);
+			}
+			hits += prog.cacheHit ? 1 : 0;
+
+			free_program(&prog);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		fprintf(stdout, "%10s  %12.2f  %8d\n",
+				cached == 1 ? "cached" : "run",
+				elapsed_usecs(&start, &end) / iterations, hits);
+	}
+
+	reset_program_cache();
+
+	return;
+}
+
+
+/*
+ * Run trivial programs as child processes, and then with our builtins.
+ */
+static void
+main_bench_builtin(int argc, char **argv)
+{
+	int iterations = 1000;
+	char *echoArgs[] = { "echo", "hello", "world", NULL };
+	char *trueArgs[] = { "true", NULL };
+	char *whichArgs[] = { "which", "cat", NULL };
+	char *catArgs[] = { "cat", "Makefile", NULL };
+	char **commands[] = { echoArgs, trueArgs, whichArgs, catArgs, NULL };
+
+	if (argc > 1)
+	{
+		commandline_help(stderr);
+		exit(1);
+	}
+
+	if (argc == 1 && (iterations = atoi(argv[0])) <= 0)
+	{
+		fprintf(stderr, "Failed to parse iterations \"%s\"\n", argv[0]);
+		exit(1);
+	}
+
+	fprintf(stdout, "%10s  %12s  %12s  %8s\n",
+			"program", "spawn us", "builtin us", "speedup");
+
+	for (int c = 0; commands[c] != NULL; c++)
+	{
+		double usecs[2];
+
+		for (int builtin = 0; builtin < 2; builtin++)
+		{
+			struct timespec start, end;
+
+			if (builtin == 1)
+			{
+				register_default_builtins();
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			for (int i = 0; i < iterations; i++)
+			{
+				Program prog = initialize_program(commands[c], false);
+
+				execute_program(&prog);
+
+				if (prog.error != 0 || prog.returnCode != 0
+					|| prog.ranBuiltin != (builtin == 1))
+				{
+					fprintf(stderr, "Failed to run program \"%s\": %s\n",
+							prog.program, strerror(prog.error));
+					exit(1);
+				}
+				free_program(&prog);
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			usecs[builtin] = elapsed_usecs(&start, &end) / iterations;
+
+			reset_program_builtins();
+		}
+
+		fprintf(stdout, "%10s  %12.1f  %12.1f  %7.0fx\n",
+				commands[c][0], usecs[0], usecs[1], usecs[0] / usecs[1]);
+	}
+
+	return;
+}
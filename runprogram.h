@@ -2,26 +2,93 @@
  * runprogram.h, copyright Citus Data, Inc.
  * License: ISC
  *
+ * Program names without a slash are searched in the PATH, using filepaths.h,
+ * which must be included first with FILEPATHS_IMPLEMENTATION defined.
  */
 
 #ifdef RUN_PROGRAM_IMPLEMENTATION
 #undef RUN_PROGRAM_IMPLEMENTATION
 
 #include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
 #include "pqexpbuffer.h"
 
 #define BUFSIZE			1024
 #define ARGS_INCREMENT	12
 
+/* read sizes and pipe sizes grow up to those for fast producers */
+#define DEFAULT_READ_SIZE		(1024 * 1024)
+#define DEFAULT_PIPE_SIZE		(1024 * 1024)
+
+#define DEFAULT_KILL_GRACE_MS	1000
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC		(1U << 2)
+#endif
+
+/* glibc 2.34 can close the inherited descriptors in posix_spawn() */
+#if defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_POSIX_SPAWN_CLOSEFROM
+#endif
+
+/*
+ * The io_uring read method uses a ring that we keep for the whole process,
+ * with provided buffers that the kernel fills with the pipes data. Those
+ * opcodes are more recent than some kernel headers (Linux 6.7).
+ */
+#define RING_ENTRIES			16
+#define RING_CQ_ENTRIES			64
+#define RING_BUFFERS			16		/* a power of two */
+#define RING_BUFFER_SIZE		(64 * 1024)
+#define RING_BUFFER_GROUP		0
+#define RING_OP_READ_MULTISHOT	49
+#define RING_OP_WAITID			50
+
+/* how often to check the PATH directories for changes, in milliseconds */
+#define PATH_CACHE_RECHECK_MS	1000
+
+/* room left for the kernel and the loader, as xargs(1) does */
+#define ARG_MAX_HEADROOM		2048
+
+/* first bytes of the result cache file */
+#define PROGRAM_CACHE_MAGIC		"RPCACHE1"
+#define PROGRAM_CACHE_MAGIC_LEN	8
+
+/* tail captures read into a ring of at least that size */
+#define MIN_TAIL_RING			(64 * 1024)
+
+/* PQExpBuffer can't grow past INT_MAX, spill to a file before that */
+#define MAX_CAPTURE_BUFFER		(1024 * 1024 * 1024)
+
 #if defined(WIN32) && !defined(__CYGWIN__)
 #define DEV_NULL "NUL"
 #else
@@ -29,28 +96,573 @@
 #endif
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+extern char **environ;
+
+/*
+ * How to create the child process. The fork() method is the historical one
+ * and the default, posix_spawn() avoids copying the parent page tables and
+ * thus keeps spawn latency flat when the parent process grows large.
+ */
+typedef enum
+{
+	PROGRAM_SPAWN_FORK = 0,
+	PROGRAM_SPAWN_POSIX_SPAWN
+} ProgramSpawnMethod;
+
+/*
+ * How to read from the child pipes and wait for it to exit. The poll() loop
+ * is the default. With io_uring we post multishot reads and a waitid once,
+ * and then each io_uring_enter() call returns many completions. We use the
+ * poll() loop when io_uring is not available, and for programs that have a
+ * timeout, a stdin buffer to write, redirected or recorded output.
+ */
+typedef enum
+{
+	PROGRAM_READ_POLL = 0,
+	PROGRAM_READ_IO_URING
+} ProgramReadMethod;
+
+struct Program;
+
+/*
+ * Output hooks are called with each chunk of data read from the child, as
+ * soon as it's been read, while the child is still running. Chunks are cut
+ * wherever read() returns, not at line boundaries. The data is only valid
+ * for the duration of the call.
+ */
+typedef void (*program_output_hook)(struct Program *prog,
+									const char *data, size_t len);
+
+/*
+ * Internal state of one of the child's output streams while we read it.
+ */
+typedef struct
+{
+	int fd;						/* read end of the pipe */
+	bool eof;					/* did we reach EOF already? */
+	PQExpBufferData buffer;		/* data read so far, or current chunk */
+	program_output_hook hook;	/* NULL, or prog->stdoutHook or stderrHook */
+
+	size_t limit;				/* how much data we keep in buffer */
+	int spillFd;				/* memfd or tmpfile past the limit, or -1 */
+	size_t spilled;				/* how many bytes we wrote in spillFd */
+	bool canSplice;				/* false once splice() failed on spillFd */
+
+	char *tail;					/* ring of the last bytes read, or NULL */
+	size_t tailSize;			/* size of the ring */
+	size_t tailPos;				/* where the next byte goes in the ring */
+	size_t tailKeep;			/* how many of the last bytes we return */
+
+	char *fixed;				/* the caller's buffer, or NULL */
+	size_t fixedSize;
+	size_t fixedLen;			/* how many bytes we wrote in there */
+
+	int targetFd;				/* where to send the data, or -1 */
+	size_t preview;				/* how much data we keep when sending it */
+	int previewPipe[2];			/* tee() the preview there, or -1 */
+
+	size_t readSize;			/* current read size, grows up to maxReadSize */
+	size_t maxReadSize;
+	int pipeSize;				/* current pipe capacity */
+	int maxPipeSize;
 
+	uint64_t bytes;				/* how many bytes we read from the pipe */
+	uint64_t reads;				/* how many read() or splice() calls */
+} ProgramStream;
+
+/*
+ * With recordOutput, the output of the child is kept in a single buffer, in
+ * the order we read it from both pipes, and each chunk we read is described
+ * by a record, so that we can replay stdout and stderr interleaved as they
+ * were produced. The chunks are read directly in the shared buffer, which
+ * keeps at most recordLimit bytes: past that the output is dropped, and
+ * outputTruncated is set. memoryLimit does not apply to recorded output.
+ */
 typedef struct
+{
+	uint64_t usecs;				/* when we read it, since the program started */
+	uint64_t offset;			/* in the Program output buffer */
+	uint32_t len;
+	uint32_t stream;			/* STDOUT_FILENO or STDERR_FILENO */
+} ProgramRecord;
+
+typedef struct Program
 {
 	char *program;
 	char **args;
+	bool ownsProgram;			/* free_program() frees program, not in args */
+	int execFd;					/* fexecve() that rather than program, or -1 */
+	char **envp;				/* environment, NULL for the current one */
+	bool sharedArgs;			/* args belong to a CommandTemplate */
+
+	/* settings, see init_program_defaults() */
 	bool setsid;				/* shall we call setsid() ? */
+	bool inheritFds;			/* keep our other descriptors open in the child */
+	ProgramSpawnMethod spawnMethod;	/* fork() or posix_spawn() ? */
+	ProgramReadMethod readMethod;	/* poll() or io_uring ? */
+
+	bool capture;				/* keep the output in stdout and stderr? */
+	program_output_hook stdoutHook;	/* called with each chunk of stdout */
+	program_output_hook stderrHook;	/* called with each chunk of stderr */
+	void *context;				/* private data for the hooks */
+
+	int timeoutMs;				/* 0 means no timeout */
+	int killGraceMs;			/* delay between SIGTERM and SIGKILL */
 
+	size_t memoryLimit;			/* per stream, 0 means no limit */
+	size_t stdoutTail;			/* only keep the last bytes, 0 keeps all */
+	size_t stderrTail;
+	char *stdoutBuffer;			/* capture there, or NULL to allocate */
+	size_t stdoutBufferSize;
+	char *stderrBuffer;
+	size_t stderrBufferSize;
+
+	size_t readSize;			/* max read size, BUFSIZE to disable growth */
+	int pipeSize;				/* max pipe size, 0 keeps the kernel default */
+
+	const char *stdinData;		/* write that to the child stdin, or NULL */
+	size_t stdinLen;
+	int stdinFd;				/* or use that as the child stdin, or -1 */
+
+	int stdoutFd;				/* send stdout there rather than capture it */
+	int stderrFd;				/* send stderr there rather than capture it */
+	size_t previewSize;			/* still capture that many bytes from those */
+	bool recordOutput;			/* capture in output and records instead */
+	size_t recordLimit;			/* both streams, 0 means no limit */
+	bool cacheResult;			/* idempotent, see open_program_cache() */
+	bool allowBuiltin;			/* run a registered builtin instead */
+	char **cacheDeps;			/* NULL terminated, files the result depends on */
+
+	/* results */
 	int error;					/* save errno when something's gone wrong */
-	int returnCode;
+	int returnCode;				/* 128 + signal number when killed */
+	int termSignal;				/* signal that killed the child, or 0 */
+	bool timedOut;				/* did we have to signal the child? */
+	double elapsedMs;			/* how long the child ran */
+	uint64_t bytesRead;			/* from both pipes, captured or not */
+	uint64_t readCalls;			/* read() and splice() system calls */
+	uint64_t waitCalls;			/* poll() or io_uring_enter() system calls */
+	uint64_t stdoutBytes;		/* bytesRead from the stdout pipe */
+	uint64_t stderrBytes;		/* bytesRead from the stderr pipe */
+
+	/* resource usage of the child, and its waited-for children */
+	double userMs;				/* CPU time spent in user mode */
+	double systemMs;			/* CPU time spent in the kernel */
+	long maxRssKB;				/* maximum resident set size */
+	long voluntarySwitches;		/* context switches, waiting for resources */
+	long involuntarySwitches;	/* context switches, preempted */
 
-	char *stdout;
+	char *stdout;				/* NUL terminated, may contain NUL bytes */
 	char *stderr;
+	size_t stdout_len;			/* captured bytes, not counting the NUL */
+	size_t stderr_len;
+	int stdoutSpillFd;			/* when not -1, stdout is mmap()ed from it */
+	int stderrSpillFd;
+
+	char *output;				/* with recordOutput, both streams */
+	size_t output_len;
+	ProgramRecord *records;		/* see init_record_iterator() */
+	int recordCount;
+	bool outputTruncated;		/* memory limit or caller's buffer is full */
+	bool cacheHit;				/* we didn't run it, the cache had the result */
+	bool ranBuiltin;			/* we called a builtin, there was no child */
+
+	/* internal state, while the child process is running */
+	pid_t pid;
+	int pidfd;					/* -1 when pidfd_open() is not supported */
+	bool reaped;				/* did we collect the exit status already? */
+	uint64_t startTime;			/* monotonic clock, in microseconds */
+	uint64_t termTime;			/* when we sent SIGTERM, 0 if we didn't */
+	bool killed;				/* did we send SIGKILL? */
+	int stdinPipe;				/* write end of the child stdin, or -1 */
+	size_t stdinWritten;		/* how much of stdinData we wrote already */
+	ProgramStream out;
+	ProgramStream err;
+	PQExpBufferData recordBuffer;	/* becomes output */
+	int recordSize;				/* allocated entries in records */
 } Program;
 
+/* replay the records of a Program, in order */
+typedef struct
+{
+	Program *prog;
+	int next;
+
+	/* the current record */
+	int stream;					/* STDOUT_FILENO or STDERR_FILENO */
+	uint64_t usecs;
+	const char *data;
+	size_t len;
+} ProgramRecordIterator;
+
+/*
+ * Iterate over the lines of some output, such as prog->stdout, and over the
+ * fields of a line. The current line or field is a pointer into the data
+ * and a length, nothing is copied nor allocated, and the data is not
+ * modified: lines and fields are not NUL terminated.
+ */
+typedef struct
+{
+	const char *next;			/* where to look for the next line */
+	const char *end;
+
+	/* the current line, without its newline */
+	const char *line;
+	size_t len;
+} ProgramLineIterator;
+
+typedef struct
+{
+	const char *next;			/* where to look for the next field */
+	const char *end;
+	char delimiter;
+	bool done;
+
+	/* the current field, without its delimiter */
+	const char *field;
+	size_t len;
+} ProgramFieldIterator;
+
+/* each running program polls at most that many file descriptors */
+#define PROGRAM_POLLFDS	4
+
+/*
+ * We cache where we found programs in the PATH, so that launching the same
+ * program again doesn't probe every PATH directory again. The cache is reset
+ * when the PATH changes, or when the modification time of one of its
+ * directories changes, which happens when a file is added or removed there.
+ */
+typedef struct
+{
+	char *name;
+	char *filename;				/* NULL when not found in the PATH */
+} ProgramPathEntry;
+
+typedef struct
+{
+	char *path;					/* PATH value the cache was built from */
+	PathList *dirs;
+	struct timespec *mtimes;	/* of each directory in dirs */
+	uint64_t checkTime;			/* when we last checked the mtimes */
+	int count;
+	int size;
+	ProgramPathEntry *entries;
+} ProgramPathCache;
+
+static ProgramPathCache programPathCache = { 0 };
+
+/*
+ * The result cache keeps the output and the exit status of the programs that
+ * are run with cacheResult, so that running them again returns the previous
+ * result without starting a child process. The key is the argv array, the
+ * environment when envp is set, and the device, inode, size and modification
+ * time of the executable and of each of the cacheDeps files. Installing a new
+ * executable or changing a dependency thus changes the key.
+ *
+ * Entries are kept in memory, and also appended to a file when one has been
+ * opened with open_program_cache(). The entries found in the file at open
+ * time are used from a read-only mmap() of it, without copying them.
+ */
+typedef struct
+{
+	uint64_t hash;				/* of the key */
+	uint32_t keyLen;
+	uint32_t stdoutLen;
+	uint32_t stderrLen;
+	int32_t returnCode;
+} ProgramCacheHeader;			/* followed by the key, stdout, and stderr */
+
+typedef struct
+{
+	uint64_t hash;
+	const char *key;
+	size_t keyLen;
+	const char *stdout;
+	size_t stdout_len;
+	const char *stderr;
+	size_t stderr_len;
+	int returnCode;
+	char *data;					/* malloc'ed, or NULL when in the mmap() */
+} ProgramCacheEntry;
+
+typedef struct
+{
+	int count;
+	int size;
+	ProgramCacheEntry *entries;
+
+	int fd;						/* the cache file, or -1 */
+	char *map;					/* its contents at open time */
+	size_t mapSize;
+} ProgramResultCache;
+
+static ProgramResultCache programResultCache = { .fd = -1 };
+
+/*
+ * Builtins are functions that we call in-process instead of starting a child
+ * process, for trivial programs such as echo or true. A builtin gets the argv
+ * array of the program and appends its output to out and err, then returns
+ * the exit status. It can also return PROGRAM_BUILTIN_SPAWN before writing
+ * anything, and the program is then started as usual.
+ *
+ * No builtin is registered by default, see register_default_builtins().
+ */
+#define PROGRAM_BUILTIN_SPAWN	-1
+
+/* the cat builtin only reads files up to that size */
+#define BUILTIN_CAT_MAX_SIZE	(64 * 1024)
+
+typedef int (*program_builtin)(struct Program *prog, int argc, char **argv,
+							   PQExpBuffer out, PQExpBuffer err);
+
+typedef struct
+{
+	char *name;
+	program_builtin function;
+} ProgramBuiltin;
+
+typedef struct
+{
+	int count;
+	int size;
+	ProgramBuiltin *entries;
+} ProgramBuiltinRegistry;
+
+static ProgramBuiltinRegistry programBuiltins = { 0 };
+
+/*
+ * A command template is a command line that we prepare once and then run
+ * many times with different values for its variable arguments, the slots,
+ * given as "{}" when compiling the template. The executable is opened once
+ * and the argv and envp arrays are built once, so that running the command
+ * doesn't need to allocate memory nor to resolve the program path again.
+ */
+#define COMMAND_SLOT	"{}"
+
+typedef struct
+{
+	Program prog;				/* settings, and the argv array */
+	int nbArgs;
+	int *slots;					/* indexes of the slots in prog.args */
+	int nbSlots;
+} CommandTemplate;
+
+/*
+ * A co-process is a child process that we start once and then exchange
+ * requests and responses with, over its stdin and stdout, one frame at a
+ * time. Frames are either a line of text, or a 4 bytes length in network
+ * byte order followed by that many bytes of data.
+ */
+typedef enum
+{
+	COPROCESS_FRAME_LINE = 0,
+	COPROCESS_FRAME_LENGTH
+} CoprocessFraming;
+
+typedef struct
+{
+	Program prog;				/* program, args and settings */
+	CoprocessFraming framing;
+	int restarts;				/* how many times we had to restart it */
+
+	int inFd;					/* write end of the child stdin, or -1 */
+	int outFd;					/* read end of the child stdout */
+	int errFd;					/* read end of the child stderr */
+
+	PQExpBufferData request;	/* current framed request */
+	PQExpBufferData outbuf;		/* data read from the child stdout */
+	size_t consumed;			/* how much of outbuf we returned already */
+	PQExpBufferData errbuf;		/* child stderr during the last call */
+} Coprocess;
+
+#ifdef HAVE_IO_URING
+typedef struct
+{
+	int fd;						/* -1 when not set up */
+	bool unavailable;			/* io_uring or its opcodes are not supported */
+
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	unsigned *sqTail;
+	unsigned sqLocalTail;		/* entries we filled, published at submit */
+	unsigned sqMask;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned toSubmit;
+
+	struct io_uring_buf_ring *bufRing;
+	size_t bufRingSize;
+	char *buffers;
+} ProgramRing;
+
+static ProgramRing programRing = { .fd = -1 };
+
+/* user_data of our requests */
+#define RING_DATA_STDOUT	1
+#define RING_DATA_STDERR	2
+#define RING_DATA_WAITID	3
+#endif
+
+
 Program run_program(const char *program, ...);
 Program initialize_program(char **args, bool setsid);
 void execute_program(Program *prog);
+void execute_programs(Program *programs, int count, int parallel,
+					  int *completed);
+void execute_pipeline(Program *stages, int count);
+int execute_batched_program(Program *prog, char **args, int count,
+							int parallel);
+bool program_start(Program *prog, struct pollfd *fds);
+bool program_on_readable(Program *prog, struct pollfd *fds);
+int program_next_timeout(Program *prog);
+void program_finish(Program *prog);
 void free_program(Program *prog);
+double program_read_throughput(Program *prog);
+void init_record_iterator(ProgramRecordIterator *iter, Program *prog);
+bool record_iterator_next(ProgramRecordIterator *iter);
+void init_line_iterator(ProgramLineIterator *iter,
+						const char *data, size_t len);
+bool line_iterator_next(ProgramLineIterator *iter);
+void init_field_iterator(ProgramFieldIterator *iter,
+						 const char *data, size_t len, char delimiter);
+bool field_iterator_next(ProgramFieldIterator *iter);
+Coprocess *start_coprocess(char **args, CoprocessFraming framing);
+bool call_coprocess(Coprocess *cop, const char *request, size_t len,
+					const char **response, size_t *responseLen);
+void stop_coprocess(Coprocess *cop);
+CommandTemplate *compile_command(char **args);
+Program run_command(CommandTemplate *cmd, char **values);
+void free_command(CommandTemplate *cmd);
 int snprintf_program_command_line(Program *prog, char *buffer, int size);
-static void read_from_pipes(Program *prog,
-							pid_t childPid, int *outpipe, int *errpipe);
-static size_t read_into_buf(int filedes, PQExpBuffer buffer);
+const char *resolve_program_path(const char *name);
+bool program_ring_available(void);
+void reset_program_path_cache(void);
+bool open_program_cache(const char *filename);
+void reset_program_cache(void);
+bool register_program_builtin(const char *name, program_builtin function);
+bool register_default_builtins(void);
+void reset_program_builtins(void);
+static void init_program_defaults(Program *prog, bool setsid);
+static void resolve_program(Program *prog);
+static bool program_path_is_resolved(Program *prog);
+static bool path_cache_is_valid(ProgramPathCache *cache, const char *path);
+static void path_cache_mtimes(ProgramPathCache *cache);
+static void path_cache_clear_entries(ProgramPathCache *cache);
+static char *search_path_dirs(PathList *dirs, const char *name);
+static const char *default_path(void);
+static bool program_uses_cache(Program *prog);
+static bool program_cache_key(Program *prog, PQExpBuffer key);
+static bool append_file_stamp(PQExpBuffer key, const char *filename, int fd);
+static bool program_cache_lookup(Program *prog, PQExpBuffer key);
+static void program_cache_store(Program *prog, PQExpBuffer key);
+static ProgramCacheEntry *program_cache_add(ProgramResultCache *cache,
+											ProgramCacheHeader *header,
+											const char *key, char *data);
+static uint64_t hash_bytes(const char *data, size_t len);
+static bool append_cache_entry(ProgramResultCache *cache,
+							   const char *data, size_t size);
+static size_t index_cache_file(ProgramResultCache *cache);
+static program_builtin find_program_builtin(Program *prog);
+static bool builtin_replaces_program(Program *prog, const char *name);
+static bool run_builtin(Program *prog, program_builtin function);
+static int builtin_echo(Program *prog, int argc, char **argv,
+						PQExpBuffer out, PQExpBuffer err);
+static int builtin_true(Program *prog, int argc, char **argv,
+						PQExpBuffer out, PQExpBuffer err);
+static int builtin_false(Program *prog, int argc, char **argv,
+						 PQExpBuffer out, PQExpBuffer err);
+static int builtin_which(Program *prog, int argc, char **argv,
+						 PQExpBuffer out, PQExpBuffer err);
+static int builtin_cat(Program *prog, int argc, char **argv,
+					   PQExpBuffer out, PQExpBuffer err);
+static size_t batch_args_size(Program *prog);
+static void add_batch_results(Program *prog, Program *batch,
+							  PQExpBuffer out, PQExpBuffer err);
+static bool start_program(Program *prog);
+static pid_t fork_program(Program *prog,
+						  int *inpipe, int *outpipe, int *errpipe);
+static pid_t spawn_program(Program *prog,
+						   int *inpipe, int *outpipe, int *errpipe);
+static void read_from_pipes(Program *prog);
+static bool program_uses_ring(Program *prog);
+#ifdef HAVE_IO_URING
+static void read_from_ring(Program *prog);
+static bool ring_handle_completion(Program *prog, struct io_uring_cqe *cqe,
+								   bool *exited);
+static bool setup_program_ring(ProgramRing *ring);
+static void free_program_ring(ProgramRing *ring);
+static struct io_uring_sqe *ring_get_sqe(ProgramRing *ring);
+static void ring_provide_buffer(ProgramRing *ring, unsigned short bid);
+static void ring_read_multishot(ProgramRing *ring, int filedes, uint64_t data);
+static void ring_waitid(ProgramRing *ring, pid_t pid, siginfo_t *info);
+#endif
+static void program_pollfds(Program *prog, struct pollfd *fds);
+static void program_handle_events(Program *prog, struct pollfd *fds);
+static int program_poll_timeout(Program *prog);
+static void program_check_deadline(Program *prog, uint64_t now);
+static void signal_program(Program *prog, int sig);
+static void write_stdin(Program *prog);
+static ssize_t write_to_child(int filedes, const char *data, size_t len);
+static bool program_is_done(Program *prog);
+static void finish_program(Program *prog);
+static void wait_for_program(Program *prog, int options);
+static int open_pidfd(pid_t pid);
+static uint64_t monotonic_usecs(void);
+static void init_program_stream(Program *prog, ProgramStream *stream,
+								size_t tail, char *fixed, size_t fixedSize,
+								int filedes, program_output_hook hook,
+								int targetFd);
+static bool program_redirects(Program *prog,
+							  int targetFd, program_output_hook hook);
+static void read_pipe(Program *prog, ProgramStream *stream);
+static void read_pipe_records(Program *prog, ProgramStream *stream);
+static void read_pipe_tail(Program *prog, ProgramStream *stream);
+static void read_pipe_fixed(Program *prog, ProgramStream *stream);
+static void append_fixed(Program *prog, ProgramStream *stream,
+						 const char *data, size_t len);
+static void process_stream_data(Program *prog, ProgramStream *stream,
+								const char *data, size_t len);
+static void append_tail(ProgramStream *stream, const char *data, size_t len);
+static char *take_tail_data(ProgramStream *stream, size_t *len);
+static bool append_record(Program *prog, ProgramStream *stream,
+						  size_t offset, size_t len);
+static ssize_t read_into_buf(int filedes, PQExpBuffer buffer,
+							 size_t size, size_t limit);
+static void adapt_read_size(ProgramStream *stream, ssize_t bytes);
+static bool spill_stream(ProgramStream *stream);
+static ssize_t splice_into_spill(ProgramStream *stream);
+static bool write_into_spill(ProgramStream *stream,
+							 const char *data, size_t len);
+static ssize_t transfer_to_target(ProgramStream *stream);
+static bool tee_preview(ProgramStream *stream, size_t len);
+static bool write_fully(int filedes, const char *data, size_t len);
+static char *take_stream_data(Program *prog, ProgramStream *stream,
+							  size_t *len, int *spillFd);
+static char *take_buffer_data(PQExpBuffer buffer, size_t *len);
+static bool spawn_coprocess(Coprocess *cop);
+static bool coprocess_is_running(Coprocess *cop);
+static void coprocess_close_child(Coprocess *cop, int sig);
+static bool coprocess_wait(Program *prog, int timeoutMs);
+static bool coprocess_response(Coprocess *cop,
+							   const char **response, size_t *responseLen);
+static bool coprocess_read(Coprocess *cop, int filedes, PQExpBuffer buffer);
+static void close_pipe(int *pipefd);
+static void child_stdio_sources(Program *prog, int *inpipe, int *outpipe,
+								int *errpipe, int *sources);
+static int dup_above_stderr(int filedes);
+static void close_stdio_copies(int *sources, int *copies, int count);
+static void redirect_fd(int filedes, int target);
+static void set_cloexec_from(int lowfd);
+static bool set_nonblocking(int filedes);
 
 
 /*
@@ -66,12 +678,8 @@ run_program(const char *program, ...)
 	const char *param;
 	Program prog;
 
+	init_program_defaults(&prog, false);
 	prog.program = strdup(program);
-	prog.returnCode = -1;
-	prog.error = 0;
-	prog.setsid = false;
-	prog.stdout = NULL;
-	prog.stderr = NULL;
 
 	prog.args = (char **) malloc(ARGS_INCREMENT * sizeof(char *));
 	prog.args[nb_args++] = prog.program;
@@ -97,6 +705,7 @@ run_program(const char *program, ...)
 	va_end(args);
 	prog.args[nb_args] = NULL;
 
+	resolve_program(&prog);
 	execute_program(&prog);
 
 	return prog;
@@ -106,7 +715,43 @@ run_program(const char *program, ...)
 /*
  * Initialize a program structure that can be executed later, allowing the
  * caller to manipulate the structure for itself. Safe to change are program,
- * args and setsid structure slots.
+ * args, and the settings structure slots, from setsid to previewSize. When
+ * the program name has been resolved in the PATH, ownsProgram is set and
+ * free_program() releases program: a caller that replaces it must free the
+ * previous one and set ownsProgram to false, or true for a malloc'ed string.
+ *
+ * When memoryLimit is set, the output of a stream past that many bytes is
+ * written to a memfd (or a temporary file), and stdout or stderr then is a
+ * read-only mmap() view of that file. free_program() knows how to release
+ * both kinds of output.
+ *
+ * When stdoutTail or stderrTail is set, only the last that many bytes of the
+ * stream are kept, in a ring buffer allocated once, so that memory usage
+ * stays flat however much the child writes. stdoutBytes and stderrBytes
+ * still count all the bytes, and stdout_len < stdoutBytes then tells that
+ * the beginning of the output has been dropped.
+ *
+ * When stdoutBuffer or stderrBuffer is set, the output of that stream is read
+ * directly into the caller's buffer, and stdout or stderr then points there.
+ * The data is always NUL terminated, so at most size - 1 bytes are kept, and
+ * outputTruncated is set when the child wrote more than that. The buffers
+ * remain owned by the caller. With a CommandTemplate, both buffers, and the
+ * fork() spawn method, running a program does not call malloc() at all.
+ *
+ * When stdoutFd or stderrFd is set, the output of that stream is sent to the
+ * given file descriptor. Unless a hook or a preview is needed the child then
+ * writes there directly, otherwise the data is moved from the pipe with
+ * splice(), and the first previewSize bytes are tee()d into stdout or stderr.
+ *
+ * The child stdin is /dev/null, unless stdinFd is set, then the child reads
+ * from that file descriptor directly, or stdinData is set. Then stdinLen
+ * bytes of stdinData are written to the child from the same poll() loop that
+ * reads its output, so that a child that writes while we feed it can't block
+ * us. The caller keeps ownership of stdinData.
+ *
+ * To process the output while the child is running, install the hooks. When
+ * capture is false, the output is not kept in memory once the hooks have seen
+ * it, and memory usage stays flat whatever the child writes.
  */
 Program
 initialize_program(char **args, bool setsid)
@@ -114,11 +759,7 @@ initialize_program(char **args, bool setsid)
 	int argsIndex, nb_args = 0;
 	Program prog;
 
-	prog.returnCode = -1;
-	prog.error = 0;
-	prog.setsid = setsid;
-	prog.stdout = NULL;
-	prog.stderr = NULL;
+	init_program_defaults(&prog, setsid);
 
 	for(argsIndex = 0; args[argsIndex] != NULL; argsIndex++)
 	{
@@ -135,129 +776,203 @@ initialize_program(char **args, bool setsid)
 	}
 	prog.program = prog.args[0];
 
+	resolve_program(&prog);
+
 	return prog;
 }
 
+
 /*
- * Run given program with its args, by doing the fork()/exec() dance, and also
- * capture the subprocess output by installing pipes. We accimulate the output
- * into an SDS data structure (Simple Dynamic Strings library).
+ * resolve_program sets prog->program to where we find it in the PATH when it
+ * has no slash, keeping args[0] as given. When the program is not found, or
+ * we're out of memory, we leave it as-is: executing it then fails with
+ * ENOENT, see program_path_is_resolved().
  */
-void
-execute_program(Program *prog)
+static void
+resolve_program(Program *prog)
 {
-	pid_t pid;
-	int outpipe[2] = {0,0};
-	int errpipe[2] = {0,0};
-
-	/* Flush stdio channels just before fork, to avoid double-output problems */
-	fflush(stdout);
-	fflush(stderr);
+	const char *filename;
+	char *program;
 
-	/* create the pipe now */
-	if (pipe(outpipe) < 0)
+	if (strchr(prog->program, '/') != NULL)
 	{
-		prog->returnCode = -1;
-		prog->error = errno;
 		return;
 	}
 
-	if (pipe(errpipe) < 0)
+	if ((filename = resolve_program_path(prog->program)) != NULL
+		&& (program = strdup(filename)) != NULL)
 	{
-		prog->returnCode = -1;
-		prog->error = errno;
-		return;
+		prog->program = program;
+		prog->ownsProgram = true;
 	}
+}
 
-	pid = fork();
 
-	switch (pid)
+/*
+ * program_path_is_resolved returns false with prog->error set to ENOENT when
+ * the program is a name without a slash, that we didn't find in the PATH.
+ * execve() would run a file of that name in the current directory, where the
+ * shell says "not found", so we never execute a bare name.
+ */
+static bool
+program_path_is_resolved(Program *prog)
+{
+	if (prog->execFd == -1 && strchr(prog->program, '/') == NULL)
 	{
-		case -1:
-		{
-			/* fork failed */
-			prog->returnCode = -1;
-			prog->error = errno;
-			return;
-		}
+		prog->returnCode = -1;
+		prog->error = ENOENT;
+		return false;
+	}
+	return true;
+}
 
-		case 0:
-		{
-			/* fork succeeded, in child */
+/*
+ * init_program_defaults sets all the Program slots but program and args to
+ * their default values.
+ */
+static void
+init_program_defaults(Program *prog, bool setsid)
+{
+	prog->ownsProgram = false;
+	prog->execFd = -1;
+	prog->envp = NULL;
+	prog->sharedArgs = false;
 
-			/*
-			 * We redirect /dev/null into stdin rather than closing stdin,
-			 * because apparently closing it may cause undefined behavior if
-			 * any read was to happen.
-			 */
-			int stdin = open(DEV_NULL, O_RDONLY);
+	prog->setsid = setsid;
+	prog->inheritFds = false;
+	prog->spawnMethod = PROGRAM_SPAWN_FORK;
+	prog->readMethod = PROGRAM_READ_POLL;
+	prog->capture = true;
+	prog->stdoutHook = NULL;
+	prog->stderrHook = NULL;
+	prog->context = NULL;
+	prog->timeoutMs = 0;
+	prog->killGraceMs = DEFAULT_KILL_GRACE_MS;
+	prog->memoryLimit = 0;
+	prog->stdoutTail = 0;
+	prog->stderrTail = 0;
+	prog->stdoutBuffer = NULL;
+	prog->stdoutBufferSize = 0;
+	prog->stderrBuffer = NULL;
+	prog->stderrBufferSize = 0;
+	prog->readSize = DEFAULT_READ_SIZE;
+	prog->pipeSize = DEFAULT_PIPE_SIZE;
+	prog->stdinData = NULL;
+	prog->stdinLen = 0;
+	prog->stdinFd = -1;
+	prog->stdoutFd = -1;
+	prog->stderrFd = -1;
+	prog->previewSize = 0;
+	prog->recordOutput = false;
+	prog->recordLimit = 0;
+	prog->cacheResult = false;
+	prog->allowBuiltin = true;
+	prog->cacheDeps = NULL;
 
-			dup2(stdin, STDIN_FILENO);
-			dup2(outpipe[1], STDOUT_FILENO);
-			dup2(errpipe[1], STDERR_FILENO);
+	prog->returnCode = -1;
+	prog->error = 0;
+	prog->termSignal = 0;
+	prog->timedOut = false;
+	prog->elapsedMs = 0;
+	prog->bytesRead = 0;
+	prog->readCalls = 0;
+	prog->waitCalls = 0;
+	prog->stdoutBytes = 0;
+	prog->stderrBytes = 0;
 
-			close(stdin);
-			close(outpipe[0]);
-			close(outpipe[1]);
-			close(errpipe[0]);
-			close(errpipe[1]);
+	prog->userMs = 0;
+	prog->systemMs = 0;
+	prog->maxRssKB = 0;
+	prog->voluntarySwitches = 0;
+	prog->involuntarySwitches = 0;
 
-			/*
-			 * When asked to do so, before creating the child process, we call
-			 * setsid() to create our own session group and detach from the
-			 * terminal. That's useful when starting a service in the
-			 * background.
-			 */
-			if (prog->setsid)
-			{
-				if (setsid() == -1)
-				{
-					prog->returnCode = -1;
-					prog->error = errno;
-					return;
-				}
-			}
+	prog->stdout = NULL;
+	prog->stderr = NULL;
+	prog->stdout_len = 0;
+	prog->stderr_len = 0;
+	prog->stdoutSpillFd = -1;
+	prog->stderrSpillFd = -1;
 
-			if (execv(prog->program, prog->args) == -1)
-			{
-				prog->returnCode = -1;
-				prog->error = errno;
-			}
-			return;
-		}
+	prog->output = NULL;
+	prog->output_len = 0;
+	prog->records = NULL;
+	prog->recordCount = 0;
+	prog->outputTruncated = false;
+	prog->cacheHit = false;
+	prog->ranBuiltin = false;
+	prog->recordSize = 0;
 
-		default:
-		{
-			/* fork succeeded, in parent */
-			read_from_pipes(prog, pid, outpipe, errpipe);
-			return;
-		}
-	}
-	return;
+	prog->pid = -1;
+	prog->pidfd = -1;
+	prog->reaped = false;
+	prog->stdinPipe = -1;
 }
 
 
 /*
- * Free our memory.
+ * Run given program with its args, by doing the fork()/exec() dance, and also
+ * capture the subprocess output by installing pipes. We accumulate the output
+ * into PQExpBuffer data structures.
+ *
+ * With cacheResult, we first look for the result in the result cache, and we
+ * add it there after running the program. A registered builtin for the
+ * program is called in-process instead.
  */
 void
-free_program(Program *prog)
+execute_program(Program *prog)
 {
-	/* don't free prog->program, it's the same pointer as prog->args[0] */
-	for (int i = 0; prog->args[i] != NULL; i++)
+	PQExpBufferData cacheKey;
+	bool useCache = program_uses_cache(prog);
+	program_builtin builtin = find_program_builtin(prog);
+
+	if (useCache)
 	{
-		free(prog->args[i]);
+		initPQExpBuffer(&cacheKey);
+
+		/* when we can't stat() the executable, just run it */
+		useCache = program_cache_key(prog, &cacheKey);
+
+		if (useCache && program_cache_lookup(prog, &cacheKey))
+		{
+			termPQExpBuffer(&cacheKey);
+			return;
+		}
 	}
-	free(prog->args);
 
-	if (prog->stdout != NULL)
+	/* builtins are cheaper than the cache, we don't store their results */
+	if (builtin != NULL && run_builtin(prog, builtin))
 	{
-		free(prog->stdout);
+		if (program_uses_cache(prog))
+		{
+			termPQExpBuffer(&cacheKey);
+		}
+		return;
 	}
 
-	if (prog->stderr != NULL)
+	if (start_program(prog))
 	{
-		free(prog->stderr);
+#ifdef HAVE_IO_URING
+		if (program_uses_ring(prog))
+		{
+			read_from_ring(prog);
+		}
+		else
+		{
+			read_from_pipes(prog);
+		}
+#else
+		read_from_pipes(prog);
+#endif
+
+		if (useCache)
+		{
+			program_cache_store(prog, &cacheKey);
+		}
+	}
+
+	if (program_uses_cache(prog))
+	{
+		termPQExpBuffer(&cacheKey);
 	}
 
 	return;
@@ -265,156 +980,5347 @@ free_program(Program *prog)
 
 
 /*
- * read_from_pipes reads the output from the child process and sets the Program
- * slots stdout and stderr with the accumulated output we read.
+ * Run a set of programs concurrently, with at most parallel children running
+ * at any time, and multiplex all their pipes and exit notifications in a
+ * single poll() loop. Each Program is executed as with execute_program().
+ *
+ * When completed is not NULL, it must have room for count entries and is
+ * filled with the indexes of the programs in the order they completed. When
+ * poll() fails, every program is completed with that error, including those
+ * that we didn't start.
  */
-static void
-read_from_pipes(Program *prog, pid_t childPid, int *outpipe, int *errpipe)
+void
+execute_programs(Program *programs, int count, int parallel, int *completed)
 {
-	bool doneReading = false;
-	int status;
-	int countFdsReadyToRead, nfds; /* see man select(3) */
-	fd_set readFileDescriptorSet;
-	ssize_t bytes_out = BUFSIZE, bytes_err = BUFSIZE;
-	PQExpBuffer outbuf, errbuf;
+	int next = 0, nbCompleted = 0, nbRunning = 0;
+	int timeout, error;
+	int *running;
+	struct pollfd *fds;
 
-	/* We read from the other side of the pipe, close that part.  */
-	close(outpipe[1]);
-	close(errpipe[1]);
+	if (parallel <= 0 || parallel > count)
+	{
+		parallel = count;
+	}
 
-	nfds = MAX(outpipe[0], errpipe[0]) + 1;
+	if (count <= 0)
+	{
+		return;
+	}
 
-	/*
-	 * Ok. the child process is running, let's read the pipes content.
-	 */
-	outbuf = createPQExpBuffer();
-	errbuf = createPQExpBuffer();
+	running = (int *) malloc(parallel * sizeof(int));
+	fds = (struct pollfd *) malloc(parallel * PROGRAM_POLLFDS
+								   * sizeof(struct pollfd));
 
-	while (!doneReading)
+	if (running == NULL || fds == NULL)
 	{
-		FD_ZERO(&readFileDescriptorSet);
+		free(running);
+		free(fds);
+
+		for (int i = 0; i < count; i++)
+		{
+			programs[i].returnCode = -1;
+			programs[i].error = ENOMEM;
+		}
+		return;
+	}
 
-		/* if we read 0 bytes on the previous run, we've reached EOF */
-		if (bytes_out > 0)
+	while (nbCompleted < count)
+	{
+		/* start as many programs as we are allowed to */
+		while (nbRunning < parallel && next < count)
 		{
-			FD_SET(outpipe[0], &readFileDescriptorSet);
+			if (start_program(&programs[next]))
+			{
+				running[nbRunning++] = next;
+			}
+			else if (completed != NULL)
+			{
+				completed[nbCompleted++] = next;
+			}
+			else
+			{
+				nbCompleted++;
+			}
+			next++;
 		}
 
-		if (bytes_err > 0)
+		if (nbRunning == 0)
 		{
-			FD_SET(errpipe[0], &readFileDescriptorSet);
+			continue;
 		}
 
-		countFdsReadyToRead =
-			select(nfds, &readFileDescriptorSet, NULL, NULL, NULL);
+		timeout = -1;
 
-		if (countFdsReadyToRead == -1)
+		for (int r = 0; r < nbRunning; r++)
 		{
-			switch (errno)
-			{
-				case EAGAIN:
-				case EINTR:
-					/* just loop again */
-					break;
+			Program *prog = &programs[running[r]];
+			int progTimeout = program_poll_timeout(prog);
+
+			program_pollfds(prog, fds + r * PROGRAM_POLLFDS);
 
-				case EBADF:
-				case EINVAL:
-				case ENOMEM:
-				default:
-					/* that's unexpected, act as if doneReading */
-					fprintf(stderr,
-							"Failed to read from command \"%s\": %s",
-							prog->program, strerror(errno));
-					doneReading = true;
-					break;
+			if (progTimeout >= 0 && (timeout == -1 || progTimeout < timeout))
+			{
+				timeout = progTimeout;
 			}
 		}
-		else if (countFdsReadyToRead == 0)
+
+		if (poll(fds, nbRunning * PROGRAM_POLLFDS, timeout) == -1)
 		{
-			continue;
+			if (errno == EINTR || errno == EAGAIN)
+			{
+				continue;
+			}
+
+			/* that's unexpected, let every program wait for its child */
+			error = errno;
+			fprintf(stderr, "Failed to read from commands: %s",
+					strerror(error));
+
+			for (int r = 0; r < nbRunning; r++)
+			{
+				Program *prog = &programs[running[r]];
+
+				prog->out.eof = prog->err.eof = true;
+				finish_program(prog);
+
+				if (prog->error == 0)
+				{
+					prog->error = error;
+				}
+
+				if (completed != NULL)
+				{
+					completed[nbCompleted] = running[r];
+				}
+				nbCompleted++;
+			}
+
+			/* and the programs we didn't start fail with the same error */
+			for (; next < count; next++)
+			{
+				programs[next].returnCode = -1;
+				programs[next].error = error;
+
+				if (completed != NULL)
+				{
+					completed[nbCompleted] = next;
+				}
+				nbCompleted++;
+			}
+			break;
 		}
-		else
+
+		for (int r = 0; r < nbRunning; r++)
 		{
-			if (FD_ISSET(outpipe[0], &readFileDescriptorSet))
+			Program *prog = &programs[running[r]];
+
+			program_handle_events(prog, fds + r * PROGRAM_POLLFDS);
+
+			if (program_is_done(prog))
 			{
-				bytes_out = read_into_buf(outpipe[0], outbuf);
+				finish_program(prog);
 
-				if (bytes_out == -1 && errno != 0)
+				if (completed != NULL)
 				{
-					prog->returnCode = -1;
-					prog->error = errno;
+					completed[nbCompleted] = running[r];
 				}
+				nbCompleted++;
+
+				/* keep running[] dense, and process the moved entry too */
+				running[r] = running[--nbRunning];
+
+				for (int f = 0; f < PROGRAM_POLLFDS; f++)
+				{
+					fds[r * PROGRAM_POLLFDS + f] =
+						fds[nbRunning * PROGRAM_POLLFDS + f];
+				}
+				r--;
+			}
+		}
+	}
+
+	free(running);
+	free(fds);
+
+	return;
+}
+
+
+/*
+ * Run a pipeline of programs, as the shell does with "a | b | c", without
+ * the shell: each stage stdout is connected to the next stage stdin with a
+ * pipe, and the data flows between the children without going through our
+ * process. We capture the last stage stdout, and the stderr of every stage.
+ * Each Program has its own results, such as returnCode and error.
+ *
+ * The first stage stdin and the last stage stdout follow the Program
+ * settings. The stdoutFd, stdoutHook, and previewSize settings of the other
+ * stages are replaced, and so is the stdinFd of all stages but the first.
+ */
+void
+execute_pipeline(Program *stages, int count)
+{
+	struct pollfd *fds;
+	bool *running;
+	int nbRunning = 0;
+	int readFd = -1;			/* read end of the previous stage stdout */
+
+	if (count <= 0)
+	{
+		return;
+	}
+
+	fds = (struct pollfd *) malloc(count * PROGRAM_POLLFDS
+								   * sizeof(struct pollfd));
+	running = (bool *) calloc(count, sizeof(bool));
+
+	if (fds == NULL || running == NULL)
+	{
+		free(fds);
+		free(running);
+
+		for (int i = 0; i < count; i++)
+		{
+			stages[i].returnCode = -1;
+			stages[i].error = ENOMEM;
+		}
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		Program *prog = &stages[i];
+		int pipefd[2] = {-1,-1};
+
+		for (int f = 0; f < PROGRAM_POLLFDS; f++)
+		{
+			fds[i * PROGRAM_POLLFDS + f].fd = -1;
+		}
+
+		if (i > 0)
+		{
+			prog->stdinFd = readFd;
+		}
+
+		if (i < count - 1)
+		{
+			if (pipe2(pipefd, O_CLOEXEC) == -1)
+			{
+				prog->returnCode = -1;
+				prog->error = errno;
+			}
+			prog->stdoutFd = pipefd[1];
+			prog->stdoutHook = NULL;
+			prog->previewSize = 0;
+		}
+
+		/* without a pipe to our stdin, the stage reads /dev/null */
+		if (prog->error == 0 && (i == 0 || readFd != -1))
+		{
+			running[i] = program_start(prog, fds + i * PROGRAM_POLLFDS);
+		}
+		else if (prog->error == 0)
+		{
+			prog->returnCode = -1;
+			prog->error = EPIPE;
+		}
+
+		if (running[i])
+		{
+			nbRunning++;
+		}
+
+		/* the children have their own copy of the pipes now */
+		if (readFd != -1)
+		{
+			close(readFd);
+		}
+
+		if (pipefd[1] != -1)
+		{
+			close(pipefd[1]);
+		}
+
+		if (i > 0)
+		{
+			prog->stdinFd = -1;
+		}
+
+		if (i < count - 1)
+		{
+			prog->stdoutFd = -1;
+		}
+
+		readFd = pipefd[0];
+	}
+
+	while (nbRunning > 0)
+	{
+		int timeout = -1;
+
+		for (int i = 0; i < count; i++)
+		{
+			int progTimeout;
+
+			if (!running[i])
+			{
+				continue;
+			}
+
+			progTimeout = program_next_timeout(&stages[i]);
+
+			if (progTimeout >= 0 && (timeout == -1 || progTimeout < timeout))
+			{
+				timeout = progTimeout;
 			}
+		}
 
-			if (FD_ISSET(errpipe[0], &readFileDescriptorSet))
+		if (poll(fds, count * PROGRAM_POLLFDS, timeout) == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN)
 			{
-				bytes_err = read_into_buf(errpipe[0], errbuf);
+				continue;
+			}
+
+			/* that's unexpected, let every stage wait for its child */
+			fprintf(stderr, "Failed to read from pipeline: %s",
+					strerror(errno));
 
-				if (bytes_err == -1 && errno != 0)
+			for (int i = 0; i < count; i++)
+			{
+				if (running[i])
 				{
-					prog->returnCode = -1;
-					prog->error = errno;
+					stages[i].out.eof = stages[i].err.eof = true;
+					program_finish(&stages[i]);
 				}
 			}
-			doneReading = (bytes_out < BUFSIZE && bytes_err < BUFSIZE);
+			break;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			struct pollfd *progFds = fds + i * PROGRAM_POLLFDS;
+
+			if (!running[i] || !program_on_readable(&stages[i], progFds))
+			{
+				continue;
+			}
+
+			program_finish(&stages[i]);
+			running[i] = false;
+			nbRunning--;
+
+			for (int f = 0; f < PROGRAM_POLLFDS; f++)
+			{
+				progFds[f].fd = -1;
+			}
 		}
 	}
 
-	/*
-	 * Now we're done reading from both STDOUT and STDERR of the child
-	 * process, so close the file descriptors and prepare the char *
-	 * strings output in our Program structure.
-	 */
-	close(outpipe[0]);
-	close(errpipe[0]);
+	free(fds);
+	free(running);
+
+	return;
+}
+
+
+/*
+ * Run a program over many arguments, as xargs(1) does: prog has the fixed
+ * part of the command line, and the count args are appended to it in as few
+ * batches as possible, each batch using as much of the kernel ARG_MAX as
+ * the environment leaves. Batches run at most parallel at a time, with
+ * execute_programs(), and each of them uses the prog settings.
+ *
+ * The output of the batches is concatenated in prog stdout and stderr, in
+ * the order of the arguments, whatever the order in which they completed.
+ * The returnCode is the first non-zero one, and the other results add up.
+ * The output is always allocated: the caller's buffers, tails, and
+ * recordOutput settings are not used for the batches.
+ *
+ * With no args the program runs once, as xargs(1) does without -r. Returns
+ * the number of batches, the caller keeps ownership of args. When we can't
+ * allocate the batches, nothing runs, returnCode is -1 and error is ENOMEM.
+ */
+int
+execute_batched_program(Program *prog, char **args, int count, int parallel)
+{
+	size_t limit = batch_args_size(prog);
+	int nbPrefix = 0, nbBatches = 0, first = 0;
+	Program *batches = NULL;
+	PQExpBufferData out, err;
+	uint64_t startTime = monotonic_usecs();
 
-	if (outbuf->len > 0)
+	while (prog->args[nbPrefix] != NULL)
 	{
-		prog->stdout = strndup(outbuf->data, outbuf->len);
+		nbPrefix++;
 	}
 
-	if (errbuf->len > 0)
+	prog->returnCode = 0;
+	prog->error = 0;
+
+	initPQExpBuffer(&out);
+	initPQExpBuffer(&err);
+
+	/* prepare all the batches first, each one gets its own argv array */
+	while (first < count || (count == 0 && nbBatches == 0))
 	{
-		prog->stderr = strndup(errbuf->data, errbuf->len);
+		Program *batch;
+		size_t size = 0;
+		int last = first;
+
+		/* always take one argument, when it's too large exec() says so */
+		while (last < count)
+		{
+			size_t argSize = strlen(args[last]) + 1 + sizeof(char *);
+
+			if (last > first && size + argSize > limit)
+			{
+				break;
+			}
+			size += argSize;
+			last++;
+		}
+
+		batch = (Program *) realloc(batches, (nbBatches + 1) * sizeof(Program));
+
+		if (batch == NULL)
+		{
+			break;
+		}
+		batches = batch;
+		batch = &(batches[nbBatches]);
+
+		*batch = *prog;
+		batch->sharedArgs = true;
+		batch->stdoutBuffer = batch->stderrBuffer = NULL;
+		batch->stdoutTail = batch->stderrTail = 0;
+		batch->recordOutput = false;
+
+		batch->args = (char **) malloc((nbPrefix + last - first + 1)
+									   * sizeof(char *));
+
+		if (batch->args == NULL)
+		{
+			break;
+		}
+		nbBatches++;
+
+		memcpy(batch->args, prog->args, nbPrefix * sizeof(char *));
+		memcpy(batch->args + nbPrefix, args + first,
+			   (last - first) * sizeof(char *));
+		batch->args[nbPrefix + last - first] = NULL;
+
+		first = last;
 	}
 
-	destroyPQExpBuffer(outbuf);
-	destroyPQExpBuffer(errbuf);
+	/* out of memory, don't run only some of the arguments */
+	if (first < count || nbBatches == 0)
+	{
+		for (int i = 0; i < nbBatches; i++)
+		{
+			free(batches[i].args);
+		}
+		free(batches);
+
+		termPQExpBuffer(&out);
+		termPQExpBuffer(&err);
 
-	/*
-	 * Now, wait until the child process is done.
-	 */
-	do
+		prog->returnCode = -1;
+		prog->error = ENOMEM;
+
+		return 0;
+	}
+
+	if (parallel <= 1)
 	{
-		if (waitpid(childPid, &status, WUNTRACED) == -1)
+		/* then we only keep the output of one batch at a time */
+		for (int i = 0; i < nbBatches; i++)
 		{
-			prog->returnCode = -1;
-			prog->error = errno;
-			return;
+			execute_program(&(batches[i]));
+			add_batch_results(prog, &(batches[i]), &out, &err);
+		}
+	}
+	else
+	{
+		execute_programs(batches, nbBatches, parallel, NULL);
+
+		for (int i = 0; i < nbBatches; i++)
+		{
+			add_batch_results(prog, &(batches[i]), &out, &err);
 		}
 	}
-	while (!WIFEXITED(status) && !WIFSIGNALED(status));
+	free(batches);
+
+	if (PQExpBufferBroken(&out) || PQExpBufferBroken(&err))
+	{
+		prog->returnCode = -1;
+		prog->error = ENOMEM;
+	}
 
-	prog->returnCode = WEXITSTATUS(status);
+	prog->stdout = take_buffer_data(&out, &(prog->stdout_len));
+	prog->stderr = take_buffer_data(&err, &(prog->stderr_len));
+	prog->elapsedMs = (monotonic_usecs() - startTime) / 1000.0;
 
-	return;
+	return nbBatches;
 }
 
 
 /*
- * Read from a file descriptor and directly appends to our buffer string.
+ * batch_args_size returns how many bytes of arguments we can add to the
+ * command line of the program: the kernel ARG_MAX, minus the environment and
+ * the fixed arguments, each string counting for its NUL terminated length
+ * and a pointer in the argv or envp array.
  */
 static size_t
-read_into_buf(int filedes, PQExpBuffer buffer)
+batch_args_size(Program *prog)
 {
-	char temp_buffer[BUFSIZE] = { 0 };
-	size_t bytes = read(filedes, temp_buffer, BUFSIZE);
+	long argMax = sysconf(_SC_ARG_MAX);
+	char **envp = prog->envp != NULL ? prog->envp : environ;
+	size_t used = ARG_MAX_HEADROOM;
 
-	if (bytes > 0)
+	/* POSIX guarantees at least 4096 bytes */
+	if (argMax <= 0)
 	{
-		appendPQExpBufferStr(buffer, temp_buffer);
+		argMax = 4096;
+	}
+
+	for (int i = 0; envp[i] != NULL; i++)
+	{
+		used += strlen(envp[i]) + 1 + sizeof(char *);
+	}
+
+	for (int i = 0; prog->args[i] != NULL; i++)
+	{
+		used += strlen(prog->args[i]) + 1 + sizeof(char *);
+	}
+
+	/* with a huge environment, still run one argument at a time */
+	return used < (size_t) argMax ? (size_t) argMax - used : 0;
+}
+
+
+/*
+ * add_batch_results adds the output and results of a batch to the program,
+ * and releases the batch.
+ */
+static void
+add_batch_results(Program *prog, Program *batch,
+				  PQExpBuffer out, PQExpBuffer err)
+{
+	if (batch->stdout != NULL)
+	{
+		appendBinaryPQExpBuffer(out, batch->stdout, batch->stdout_len);
+	}
+
+	if (batch->stderr != NULL)
+	{
+		appendBinaryPQExpBuffer(err, batch->stderr, batch->stderr_len);
+	}
+
+	if (prog->error == 0 && batch->error != 0)
+	{
+		prog->error = batch->error;
+	}
+
+	if (prog->returnCode == 0 && batch->returnCode != 0)
+	{
+		prog->returnCode = batch->returnCode;
+	}
+
+	prog->timedOut = prog->timedOut || batch->timedOut;
+	prog->bytesRead += batch->bytesRead;
+	prog->readCalls += batch->readCalls;
+	prog->waitCalls += batch->waitCalls;
+	prog->stdoutBytes += batch->stdoutBytes;
+	prog->stderrBytes += batch->stderrBytes;
+
+	prog->userMs += batch->userMs;
+	prog->systemMs += batch->systemMs;
+	prog->maxRssKB = MAX(prog->maxRssKB, batch->maxRssKB);
+	prog->voluntarySwitches += batch->voluntarySwitches;
+	prog->involuntarySwitches += batch->involuntarySwitches;
+
+	/* the strings belong to prog and to the caller, only free the array */
+	free(batch->args);
+	free_program(batch);
+}
+
+
+/*
+ * Asynchronous API, for callers that have their own event loop and can't
+ * block in execute_program(). The life cycle of a Program is then:
+ *
+ *   program_start(&prog, fds);
+ *   ... wait for events on fds, within program_next_timeout(&prog) ...
+ *   while (!program_on_readable(&prog, fds)) ...
+ *   program_finish(&prog);
+ *
+ * The fds array has PROGRAM_POLLFDS entries: the stdout and stderr pipes, the
+ * child pidfd, and the child stdin pipe when writing stdinData. Each entry
+ * has the fd and the events to wait for, and fd is -1 when there's nothing
+ * to wait for in that slot. The caller sets revents for the fds that are
+ * ready, as poll() does, and translates from epoll or another API when
+ * needed. An entry that goes from a valid fd to -1 must be removed from the
+ * caller's event loop, as the descriptor is closed in program_finish().
+ */
+
+/*
+ * program_start starts the program and fills in fds with the descriptors to
+ * watch. Returns false with prog->error set when the program could not be
+ * started, and then there's no need to call program_finish().
+ */
+bool
+program_start(Program *prog, struct pollfd *fds)
+{
+	if (!start_program(prog))
+	{
+		return false;
+	}
+
+	program_pollfds(prog, fds);
+
+	return true;
+}
+
+
+/*
+ * program_on_readable processes the events the caller found in fds[].revents,
+ * reading from the pipes, writing to the child stdin, and checking the
+ * timeout. Then fds is filled in again with what to watch next. Returns true
+ * when the program is done, and program_finish() should be called.
+ *
+ * It's fine to call this function with no revents set, when the caller's
+ * event loop timed out as per program_next_timeout().
+ */
+bool
+program_on_readable(Program *prog, struct pollfd *fds)
+{
+	program_handle_events(prog, fds);
+	program_pollfds(prog, fds);
+
+	return program_is_done(prog);
+}
+
+
+/*
+ * program_next_timeout returns in how many milliseconds the caller should
+ * call program_on_readable() even when there were no events, or -1 when
+ * there is no need to.
+ */
+int
+program_next_timeout(Program *prog)
+{
+	return program_poll_timeout(prog);
+}
+
+
+/*
+ * program_finish reaps the child process, closes the descriptors, and sets
+ * the Program results, as execute_program() does.
+ */
+void
+program_finish(Program *prog)
+{
+	finish_program(prog);
+}
+
+
+/*
+ * start_program creates the pipes and the child process, and prepares the
+ * Program internal state for reading from the child. Returns false with
+ * prog->error set when the program could not be started.
+ */
+static bool
+start_program(Program *prog)
+{
+	int inpipe[2] = {-1,-1};
+	int outpipe[2] = {0,0};
+	int errpipe[2] = {0,0};
+
+	prog->pid = -1;
+	prog->pidfd = -1;
+	prog->reaped = false;
+	prog->timedOut = false;
+	prog->termSignal = 0;
+	prog->termTime = 0;
+	prog->killed = false;
+	prog->stdinPipe = -1;
+	prog->stdinWritten = 0;
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	/*
+	 * Create the pipes now, close-on-exec so that other children don't
+	 * inherit them: our end of the stdin pipe would keep the child from
+	 * seeing EOF on its stdin, and the write ends of the output pipes would
+	 * keep us from seeing EOF when our child is done.
+	 */
+	if (prog->stdinData != NULL && pipe2(inpipe, O_CLOEXEC) < 0)
+	{
+		prog->returnCode = -1;
+		prog->error = errno;
+		return false;
+	}
+
+	if (pipe2(outpipe, O_CLOEXEC) < 0)
+	{
+		prog->returnCode = -1;
+		prog->error = errno;
+
+		close_pipe(inpipe);
+		return false;
+	}
+
+	if (pipe2(errpipe, O_CLOEXEC) < 0)
+	{
+		prog->returnCode = -1;
+		prog->error = errno;
+
+		close_pipe(inpipe);
+		close_pipe(outpipe);
+		return false;
+	}
+
+	if (prog->spawnMethod == PROGRAM_SPAWN_POSIX_SPAWN)
+	{
+		prog->pid = spawn_program(prog, inpipe, outpipe, errpipe);
+	}
+	else
+	{
+		prog->pid = fork_program(prog, inpipe, outpipe, errpipe);
+	}
+
+	/* We read from the other side of the pipe, close that part.  */
+	close(outpipe[1]);
+	close(errpipe[1]);
+
+	/* And we write to the other side of the stdin pipe */
+	if (inpipe[0] != -1)
+	{
+		close(inpipe[0]);
+	}
+
+	if (prog->pid == -1)
+	{
+		close(outpipe[0]);
+		close(errpipe[0]);
+
+		if (inpipe[1] != -1)
+		{
+			close(inpipe[1]);
+		}
+		return false;
+	}
+
+	prog->startTime = monotonic_usecs();
+
+	if (!set_nonblocking(outpipe[0]) || !set_nonblocking(errpipe[0])
+		|| (inpipe[1] != -1 && !set_nonblocking(inpipe[1])))
+	{
+		prog->returnCode = -1;
+		prog->error = errno;
+	}
+
+	/* the child sees EOF on its stdin once we close our end */
+	if (inpipe[1] != -1 && prog->stdinLen > 0)
+	{
+		prog->stdinPipe = inpipe[1];
+	}
+	else if (inpipe[1] != -1)
+	{
+		close(inpipe[1]);
+	}
+
+	/* when pidfd_open() isn't supported, we waitpid() after reading */
+	prog->pidfd = open_pidfd(prog->pid);
+
+	init_program_stream(prog, &(prog->out), prog->stdoutTail,
+						prog->stdoutBuffer, prog->stdoutBufferSize,
+						outpipe[0], prog->stdoutHook, prog->stdoutFd);
+	init_program_stream(prog, &(prog->err), prog->stderrTail,
+						prog->stderrBuffer, prog->stderrBufferSize,
+						errpipe[0], prog->stderrHook, prog->stderrFd);
+
+	if (prog->recordOutput)
+	{
+		initPQExpBuffer(&(prog->recordBuffer));
+	}
+
+	return true;
+}
+
+
+/*
+ * fork_program starts the child process with fork() and execv(), or fexecve()
+ * when we have an execFd.
+ *
+ * The child reports a failure to exec (or to setsid) over a close-on-exec
+ * pipe, so that the parent can set prog->error just like with posix_spawn(),
+ * and the child exits rather than returning into the caller's code.
+ *
+ * Returns the child pid, or -1 with prog->error set when something failed.
+ */
+static pid_t
+fork_program(Program *prog, int *inpipe, int *outpipe, int *errpipe)
+{
+	pid_t pid;
+	int execpipe[2];
+	int childErrno = 0;
+	ssize_t bytes;
+
+	if (!program_path_is_resolved(prog))
+	{
+		return -1;
+	}
+
+	if (pipe2(execpipe, O_CLOEXEC) < 0)
+	{
+		prog->returnCode = -1;
+		prog->error = errno;
+		return -1;
+	}
+
+	pid = fork();
+
+	switch (pid)
+	{
+		case -1:
+		{
+			/* fork failed */
+			prog->returnCode = -1;
+			prog->error = errno;
+
+			close(execpipe[0]);
+			close(execpipe[1]);
+			return -1;
+		}
+
+		case 0:
+		{
+			/* fork succeeded, in child */
+			int sources[3];
+
+			/*
+			 * Move the descriptors that are one of our standard streams out
+			 * of the way first, so that installing stdout can't overwrite
+			 * the descriptor we then install as stderr, as when stderrFd is
+			 * STDOUT_FILENO. When fcntl() fails, we do as well as we can.
+			 */
+			child_stdio_sources(prog, inpipe, outpipe, errpipe, sources);
+
+			for (int i = 0; i < 3; i++)
+			{
+				int copy = dup_above_stderr(sources[i]);
+
+				if (copy != -1)
+				{
+					sources[i] = copy;
+				}
+			}
+
+			/*
+			 * We redirect /dev/null into stdin rather than closing stdin,
+			 * because apparently closing it may cause undefined behavior if
+			 * any read was to happen.
+			 */
+			if (sources[STDIN_FILENO] == -1)
+			{
+				sources[STDIN_FILENO] = open(DEV_NULL, O_RDONLY | O_CLOEXEC);
+			}
+
+			for (int i = 0; i < 3; i++)
+			{
+				redirect_fd(sources[i], i);
+			}
+
+			/*
+			 * Our pipes are close-on-exec already. Unless asked otherwise,
+			 * do the same for every other descriptor we might have, such as
+			 * sockets: the child has no use for them. We still need the
+			 * execpipe and execFd until exec() succeeds.
+			 */
+			if (!prog->inheritFds)
+			{
+				set_cloexec_from(STDERR_FILENO + 1);
+			}
+
+			/*
+			 * When asked to do so, before creating the child process, we call
+			 * setsid() to create our own session group and detach from the
+			 * terminal. That's useful when starting a service in the
+			 * background.
+			 */
+			if (prog->setsid && setsid() == -1)
+			{
+				childErrno = errno;
+			}
+			else
+			{
+				char **envp = prog->envp != NULL ? prog->envp : environ;
+
+				/* scripts can't be run from a close-on-exec execFd */
+				if (prog->execFd != -1)
+				{
+					(void) fexecve(prog->execFd, prog->args, envp);
+				}
+
+				(void) execve(prog->program, prog->args, envp);
+				childErrno = errno;
+			}
+
+			(void) write(execpipe[1], &childErrno, sizeof(childErrno));
+			_exit(127);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent: wait until the child did exec */
+			close(execpipe[1]);
+
+			do
+			{
+				bytes = read(execpipe[0], &childErrno, sizeof(childErrno));
+			}
+			while (bytes == -1 && errno == EINTR);
+
+			close(execpipe[0]);
+
+			if (bytes == sizeof(childErrno))
+			{
+				/* reap the child, which failed to exec */
+				while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+
+				prog->returnCode = -1;
+				prog->error = childErrno;
+				return -1;
+			}
+			return pid;
+		}
+	}
+}
+
+
+/*
+ * spawn_program starts the child process with posix_spawn(), installing the
+ * same redirections as the fork() code path in fork_program: /dev/null or our
+ * pipe as stdin, and our pipes as stdout and stderr. The setsid() call is
+ * done with the POSIX_SPAWN_SETSID attribute.
+ *
+ * Returns the child pid, or -1 with prog->error set when something failed.
+ */
+static pid_t
+spawn_program(Program *prog, int *inpipe, int *outpipe, int *errpipe)
+{
+	pid_t pid = -1;
+	int err;
+	short flags = 0;
+	int sources[3];
+	int copies[3];
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+
+#ifndef HAVE_POSIX_SPAWN_CLOSEFROM
+	/* we can't close the descriptors we inherited, fork() can */
+	if (!prog->inheritFds)
+	{
+		return fork_program(prog, inpipe, outpipe, errpipe);
+	}
+#endif
+
+	/* posix_spawn() runs whatever is at the path now, not the file we opened */
+	if (prog->execFd != -1)
+	{
+		return fork_program(prog, inpipe, outpipe, errpipe);
+	}
+
+	if (!program_path_is_resolved(prog))
+	{
+		return -1;
+	}
+
+	/* as in fork_program(), don't let a dup2() overwrite a later source */
+	child_stdio_sources(prog, inpipe, outpipe, errpipe, sources);
+
+	for (int i = 0; i < 3; i++)
+	{
+		copies[i] = dup_above_stderr(sources[i]);
+
+		if (copies[i] == -1 && sources[i] != -1)
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			close_stdio_copies(sources, copies, i);
+			return -1;
+		}
+	}
+
+	if ((err = posix_spawn_file_actions_init(&actions)) != 0)
+	{
+		close_stdio_copies(sources, copies, 3);
+
+		prog->returnCode = -1;
+		prog->error = err;
+		return -1;
+	}
+
+	if ((err = posix_spawnattr_init(&attr)) != 0)
+	{
+		posix_spawn_file_actions_destroy(&actions);
+		close_stdio_copies(sources, copies, 3);
+
+		prog->returnCode = -1;
+		prog->error = err;
+		return -1;
+	}
+
+	/* our pipes are close-on-exec, dup2() clears the flag on the copy */
+	if (copies[STDIN_FILENO] != -1)
+	{
+		posix_spawn_file_actions_adddup2(&actions,
+										 copies[STDIN_FILENO], STDIN_FILENO);
+	}
+	else
+	{
+		posix_spawn_file_actions_addopen(&actions,
+										 STDIN_FILENO, DEV_NULL, O_RDONLY, 0);
+	}
+	posix_spawn_file_actions_adddup2(&actions,
+									 copies[STDOUT_FILENO], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions,
+									 copies[STDERR_FILENO], STDERR_FILENO);
+
+#ifdef HAVE_POSIX_SPAWN_CLOSEFROM
+	if (!prog->inheritFds)
+	{
+		posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+	}
+#endif
+
+#ifdef POSIX_SPAWN_USEVFORK
+	/* older glibc versions only avoid the fork() when asked to */
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
+
+	if (prog->setsid)
+	{
+#ifdef POSIX_SPAWN_SETSID
+		flags |= POSIX_SPAWN_SETSID;
+#else
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		close_stdio_copies(sources, copies, 3);
+
+		prog->returnCode = -1;
+		prog->error = ENOTSUP;
+		return -1;
+#endif
+	}
+
+	if (flags != 0)
+	{
+		posix_spawnattr_setflags(&attr, flags);
+	}
+
+	err = posix_spawn(&pid, prog->program, &actions, &attr,
+					  prog->args,
+					  prog->envp != NULL ? prog->envp : environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close_stdio_copies(sources, copies, 3);
+
+	if (err != 0)
+	{
+		prog->returnCode = -1;
+		prog->error = err;
+		return -1;
+	}
+
+	return pid;
+}
+
+
+/*
+ * Free our memory.
+ */
+void
+free_program(Program *prog)
+{
+	if (!prog->sharedArgs)
+	{
+		if (prog->ownsProgram)
+		{
+			free(prog->program);
+		}
+
+		for (int i = 0; prog->args[i] != NULL; i++)
+		{
+			free(prog->args[i]);
+		}
+		free(prog->args);
+	}
+
+	if (prog->stdoutSpillFd != -1)
+	{
+		munmap(prog->stdout, prog->stdout_len + 1);
+		close(prog->stdoutSpillFd);
+	}
+	else if (prog->stdout != NULL && prog->stdout != prog->stdoutBuffer)
+	{
+		free(prog->stdout);
+	}
+
+	if (prog->stderrSpillFd != -1)
+	{
+		munmap(prog->stderr, prog->stderr_len + 1);
+		close(prog->stderrSpillFd);
+	}
+	else if (prog->stderr != NULL && prog->stderr != prog->stderrBuffer)
+	{
+		free(prog->stderr);
+	}
+
+	free(prog->output);
+	free(prog->records);
+
+	return;
+}
+
+
+/*
+ * read_from_pipes reads the output from the child process and sets the Program
+ * slots stdout and stderr with the accumulated output we read.
+ *
+ * We use poll() rather than select() so that file descriptor numbers above
+ * FD_SETSIZE are supported, and the pipes are set to non-blocking mode so that
+ * each time poll() wakes us up we can read until the pipe is empty. We are
+ * done reading only when we have reached EOF on both pipes.
+ */
+static void
+read_from_pipes(Program *prog)
+{
+	struct pollfd fds[PROGRAM_POLLFDS];
+
+	while (!program_is_done(prog))
+	{
+		program_pollfds(prog, fds);
+
+		prog->waitCalls++;
+
+		if (poll(fds, PROGRAM_POLLFDS, program_poll_timeout(prog)) == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+			{
+				/* just loop again */
+				continue;
+			}
+
+			/* that's unexpected, act as if we're done reading */
+			fprintf(stderr,
+					"Failed to read from command \"%s\": %s",
+					prog->program, strerror(errno));
+
+			prog->out.eof = prog->err.eof = true;
+			break;
+		}
+
+		program_handle_events(prog, fds);
+	}
+
+	finish_program(prog);
+
+	return;
+}
+
+
+/*
+ * program_pollfds fills in PROGRAM_POLLFDS entries of fds for the given
+ * running program: its stdout and stderr pipes, its pidfd, and its stdin pipe
+ * while we have data to write there. Entries that
+ * we are not interested in anymore get a negative fd, which poll() ignores.
+ */
+static void
+program_pollfds(Program *prog, struct pollfd *fds)
+{
+	fds[0].fd = prog->out.eof ? -1 : prog->out.fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	fds[1].fd = prog->err.eof ? -1 : prog->err.fd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+
+	fds[2].fd = prog->reaped ? -1 : prog->pidfd;
+	fds[2].events = POLLIN;
+	fds[2].revents = 0;
+
+	fds[3].fd = prog->stdinPipe;
+	fds[3].events = POLLOUT;
+	fds[3].revents = 0;
+}
+
+
+/*
+ * program_handle_events processes the poll() results for the given program,
+ * as prepared by program_pollfds, and then enforces its deadline. It's called
+ * after each poll() call, including when poll() timed out.
+ */
+static void
+program_handle_events(Program *prog, struct pollfd *fds)
+{
+	if (fds[0].fd >= 0 && fds[0].revents != 0)
+	{
+		read_pipe(prog, &(prog->out));
+	}
+
+	if (fds[1].fd >= 0 && fds[1].revents != 0)
+	{
+		read_pipe(prog, &(prog->err));
+	}
+
+	if (fds[3].fd >= 0 && fds[3].revents != 0)
+	{
+		write_stdin(prog);
+	}
+
+	/* the pidfd becomes readable when the child has terminated */
+	if (fds[2].fd >= 0 && fds[2].revents != 0)
+	{
+		wait_for_program(prog, WNOHANG);
+	}
+
+	/* without a pidfd, check if a child with a deadline has terminated */
+	if (prog->pidfd == -1 && prog->timeoutMs > 0
+		&& prog->out.eof && prog->err.eof && !prog->reaped)
+	{
+		wait_for_program(prog, WNOHANG);
+	}
+
+	if (prog->timeoutMs > 0 && !prog->reaped)
+	{
+		program_check_deadline(prog, monotonic_usecs());
+	}
+}
+
+
+/*
+ * program_poll_timeout returns how many milliseconds poll() may wait before
+ * we have to act on the program deadline, or -1 when poll() may block.
+ */
+static int
+program_poll_timeout(Program *prog)
+{
+	uint64_t now, next;
+
+	if (prog->timeoutMs <= 0 || prog->reaped)
+	{
+		return -1;
+	}
+
+	/* without a pidfd we need to check for the child exit every now and then */
+	if (prog->pidfd == -1 && prog->out.eof && prog->err.eof)
+	{
+		return 10;
+	}
+
+	if (prog->killed)
+	{
+		return -1;
+	}
+
+	now = monotonic_usecs();
+
+	if (prog->termTime == 0)
+	{
+		next = prog->startTime + (uint64_t) prog->timeoutMs * 1000;
+	}
+	else
+	{
+		next = prog->termTime + (uint64_t) prog->killGraceMs * 1000;
+	}
+
+	/* round up, so that we don't wake up just before the deadline */
+	return next <= now ? 0 : (int) ((next - now + 999) / 1000);
+}
+
+
+/*
+ * program_check_deadline sends SIGTERM to the child when its deadline has
+ * passed, and then SIGKILL when it's still running killGraceMs later.
+ */
+static void
+program_check_deadline(Program *prog, uint64_t now)
+{
+	if (prog->termTime == 0)
+	{
+		if (now >= prog->startTime + (uint64_t) prog->timeoutMs * 1000)
+		{
+			prog->timedOut = true;
+			prog->termTime = now;
+
+			signal_program(prog, SIGTERM);
+		}
+	}
+	else if (!prog->killed
+			 && now >= prog->termTime + (uint64_t) prog->killGraceMs * 1000)
+	{
+		prog->killed = true;
+
+		signal_program(prog, SIGKILL);
+	}
+}
+
+
+/*
+ * signal_program sends the given signal to our child process, or to its whole
+ * process group when we did setsid() for it. The pidfd, when we have one,
+ * makes sure that we never signal another process that re-used the pid.
+ */
+static void
+signal_program(Program *prog, int sig)
+{
+	if (prog->setsid)
+	{
+		/* after setsid() the child is the leader of its process group */
+		(void) kill(-prog->pid, sig);
+		return;
+	}
+
+#ifdef SYS_pidfd_send_signal
+	if (prog->pidfd != -1)
+	{
+		if (syscall(SYS_pidfd_send_signal, prog->pidfd, sig, NULL, 0) == 0)
+		{
+			return;
+		}
+	}
+#endif
+
+	(void) kill(prog->pid, sig);
+}
+
+
+/*
+ * write_stdin writes as much of prog->stdinData as the child stdin pipe
+ * accepts for now, and closes the pipe once we're done, or when the child
+ * closed its stdin: that's not an error, the child might not need more data.
+ */
+static void
+write_stdin(Program *prog)
+{
+	while (prog->stdinWritten < prog->stdinLen)
+	{
+		ssize_t bytes = write_to_child(prog->stdinPipe,
+									   prog->stdinData + prog->stdinWritten,
+									   prog->stdinLen - prog->stdinWritten);
+
+		if (bytes > 0)
+		{
+			prog->stdinWritten += bytes;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return;
+		}
+		else
+		{
+			if (errno != EPIPE)
+			{
+				prog->returnCode = -1;
+				prog->error = errno;
+			}
+			break;
+		}
+	}
+
+	close(prog->stdinPipe);
+	prog->stdinPipe = -1;
+}
+
+
+/*
+ * write_to_child writes to a pipe that the child may have closed already, in
+ * which case we get EPIPE and we must not get killed by SIGPIPE: we block the
+ * signal for the duration of the write, and consume it if it was raised.
+ * Only the calling thread's mask changes, as sigprocmask() is unspecified in
+ * a multi-threaded process.
+ */
+static ssize_t
+write_to_child(int filedes, const char *data, size_t len)
+{
+	sigset_t pipeMask, oldMask;
+	ssize_t bytes;
+	int savedErrno;
+
+	sigemptyset(&pipeMask);
+	sigaddset(&pipeMask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeMask, &oldMask);
+
+	bytes = write(filedes, data, len);
+	savedErrno = errno;
+
+	if (bytes == -1 && errno == EPIPE && !sigismember(&oldMask, SIGPIPE))
+	{
+		struct timespec noWait = { 0, 0 };
+
+		(void) sigtimedwait(&pipeMask, NULL, &noWait);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+	errno = savedErrno;
+
+	return bytes;
+}
+
+
+/*
+ * program_is_done returns true when we have read all the output of the child
+ * and, when we have a pidfd, the child has terminated.
+ *
+ * A child that we had to signal is done as soon as it has terminated, even if
+ * some of its own children still hold the pipes open.
+ */
+static bool
+program_is_done(Program *prog)
+{
+	if (prog->timedOut && prog->reaped)
+	{
+		return true;
+	}
+
+	return prog->out.eof
+		&& prog->err.eof
+		&& (prog->reaped || (prog->pidfd == -1 && prog->timeoutMs <= 0));
+}
+
+
+/*
+ * finish_program closes the file descriptors, hands over the buffers to our
+ * Program structure, and waits until the child process is done.
+ */
+static void
+finish_program(Program *prog)
+{
+	if (prog->stdinPipe != -1)
+	{
+		close(prog->stdinPipe);
+		prog->stdinPipe = -1;
+	}
+
+	/* a child that timed-out may have left some data in the pipes */
+	if (!prog->out.eof)
+	{
+		read_pipe(prog, &(prog->out));
+	}
+
+	if (!prog->err.eof)
+	{
+		read_pipe(prog, &(prog->err));
+	}
+
+	close(prog->out.fd);
+	close(prog->err.fd);
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (prog->out.previewPipe[i] != -1)
+		{
+			close(prog->out.previewPipe[i]);
+		}
+
+		if (prog->err.previewPipe[i] != -1)
+		{
+			close(prog->err.previewPipe[i]);
+		}
+	}
+
+	prog->bytesRead = prog->out.bytes + prog->err.bytes;
+	prog->readCalls = prog->out.reads + prog->err.reads;
+	prog->stdoutBytes = prog->out.bytes;
+	prog->stderrBytes = prog->err.bytes;
+
+	prog->stdout = take_stream_data(prog, &(prog->out),
+									&(prog->stdout_len), &(prog->stdoutSpillFd));
+	prog->stderr = take_stream_data(prog, &(prog->err),
+									&(prog->stderr_len), &(prog->stderrSpillFd));
+
+	if (prog->recordOutput)
+	{
+		prog->output = take_buffer_data(&(prog->recordBuffer),
+										&(prog->output_len));
+	}
+
+	if (!prog->reaped)
+	{
+		wait_for_program(prog, 0);
+	}
+
+	if (prog->pidfd != -1)
+	{
+		close(prog->pidfd);
+		prog->pidfd = -1;
+	}
+
+	return;
+}
+
+
+/*
+ * wait_for_program calls wait4() for our child process and sets
+ * prog->returnCode and its resource usage once the child has terminated. The
+ * usage covers the grand-children the child waited for. With WNOHANG in options,
+ * returns immediately if the child is still running.
+ *
+ * As the shell does, a child killed by a signal gets 128 plus the signal
+ * number as its returnCode, so that it never looks like a success.
+ */
+static void
+wait_for_program(Program *prog, int options)
+{
+	int status;
+	struct rusage usage;
+
+	for (;;)
+	{
+		pid_t pid = wait4(prog->pid, &status, WUNTRACED | options, &usage);
+
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			prog->returnCode = -1;
+			prog->error = errno;
+			prog->reaped = true;
+			return;
+		}
+		else if (pid == 0)
+		{
+			/* WNOHANG and the child is still running */
+			return;
+		}
+		else if (WIFEXITED(status) || WIFSIGNALED(status))
+		{
+			break;
+		}
+	}
+
+	prog->reaped = true;
+	prog->termSignal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+	prog->returnCode = WIFSIGNALED(status)
+		? 128 + WTERMSIG(status)
+		: WEXITSTATUS(status);
+	prog->elapsedMs = (monotonic_usecs() - prog->startTime) / 1000.0;
+
+	prog->userMs = usage.ru_utime.tv_sec * 1000.0
+		+ usage.ru_utime.tv_usec / 1000.0;
+	prog->systemMs = usage.ru_stime.tv_sec * 1000.0
+		+ usage.ru_stime.tv_usec / 1000.0;
+	prog->maxRssKB = usage.ru_maxrss;
+	prog->voluntarySwitches = usage.ru_nvcsw;
+	prog->involuntarySwitches = usage.ru_nivcsw;
+
+	return;
+}
+
+
+/*
+ * monotonic_usecs returns the current time of the monotonic clock, in
+ * microseconds.
+ */
+static uint64_t
+monotonic_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * open_pidfd returns a file descriptor that becomes readable when the given
+ * process terminates, or -1 when the system doesn't support pidfd_open().
+ */
+static int
+open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+
+/*
+ * init_program_stream prepares a ProgramStream to read from filedes.
+ */
+static void
+init_program_stream(Program *prog, ProgramStream *stream,
+					size_t tail, char *fixed, size_t fixedSize,
+					int filedes, program_output_hook hook, int targetFd)
+{
+	stream->fd = filedes;
+	stream->hook = hook;
+
+	/* when the child writes directly to the target, there's nothing to read */
+	stream->eof = program_redirects(prog, targetFd, hook);
+
+	stream->targetFd = targetFd;
+	stream->preview = prog->capture ? prog->previewSize : 0;
+	stream->previewPipe[0] = stream->previewPipe[1] = -1;
+	stream->canSplice = true;
+
+	/* otherwise, without a hook, we tee() the preview and splice() the data */
+	if (targetFd != -1 && hook == NULL && stream->preview > 0)
+	{
+		if (pipe2(stream->previewPipe, O_CLOEXEC | O_NONBLOCK) == -1)
+		{
+			/* we'll use read() and write() instead, to keep the preview */
+			stream->previewPipe[0] = stream->previewPipe[1] = -1;
+			stream->canSplice = false;
+		}
+	}
+
+	stream->limit = MAX_CAPTURE_BUFFER;
+	stream->spillFd = -1;
+	stream->spilled = 0;
+
+	stream->tail = NULL;
+	stream->tailSize = 0;
+	stream->tailPos = 0;
+	stream->tailKeep = 0;
+
+	stream->fixed = NULL;
+	stream->fixedSize = 0;
+	stream->fixedLen = 0;
+
+	/* recorded output keeps both streams in the same buffer, in full */
+	if (fixed != NULL && fixedSize > 0
+		&& prog->capture && targetFd == -1 && !prog->recordOutput)
+	{
+		stream->fixed = fixed;
+		stream->fixedSize = fixedSize;
+		stream->fixed[0] = '\0';
+	}
+	else if (tail > 0 && prog->capture && targetFd == -1 && !prog->recordOutput)
+	{
+		stream->tailSize = MAX(tail, MIN_TAIL_RING);
+		stream->tail = (char *) malloc(stream->tailSize);
+
+		/* without memory for the ring, capture it all */
+		stream->tailKeep = stream->tail == NULL ? 0 : tail;
+	}
+
+	stream->readSize = BUFSIZE;
+	stream->maxReadSize = MAX(prog->readSize, BUFSIZE);
+	stream->pipeSize = 0;
+	stream->maxPipeSize = prog->pipeSize;
+	stream->bytes = 0;
+	stream->reads = 0;
+
+#ifdef F_GETPIPE_SZ
+	if (stream->maxPipeSize > 0 && filedes != -1)
+	{
+		stream->pipeSize = fcntl(filedes, F_GETPIPE_SZ);
+	}
+#endif
+
+	if (prog->memoryLimit > 0 && prog->memoryLimit < MAX_CAPTURE_BUFFER)
+	{
+		/* we need room for at least one read */
+		stream->limit = MAX(prog->memoryLimit, BUFSIZE);
+	}
+
+	/* termPQExpBuffer() is fine with that, and doesn't allocate */
+	if (stream->fixed != NULL)
+	{
+		memset(&(stream->buffer), 0, sizeof(PQExpBufferData));
+		return;
+	}
+
+	initPQExpBuffer(&(stream->buffer));
+}
+
+
+/*
+ * program_redirects returns true when the child process should write the
+ * given stream directly to targetFd, because we don't need to see the data.
+ */
+static bool
+program_redirects(Program *prog, int targetFd, program_output_hook hook)
+{
+	return targetFd != -1
+		&& hook == NULL
+		&& (prog->previewSize == 0 || !prog->capture);
+}
+
+
+/*
+ * read_pipe reads from a non-blocking pipe until there is nothing more to read
+ * for now, and sets stream->eof when we have reached EOF, or a read error that
+ * we can't recover from.
+ *
+ * Each chunk of data is passed to the stream hook when there's one, and when
+ * we're not capturing the output we then forget about the chunk, re-using the
+ * same buffer space for the next read.
+ *
+ * When capturing more than stream->limit bytes, the data is spilled to a file
+ * instead: with splice() when there's no hook to call, so that the data never
+ * goes through user space, and otherwise one chunk at a time from our buffer.
+ * Reads are capped to what's left under the limit, so that a small limit also
+ * bounds the buffer size whatever the adaptive read size has grown to.
+ */
+static void
+read_pipe(Program *prog, ProgramStream *stream)
+{
+	if (prog->recordOutput && prog->capture && stream->targetFd == -1)
+	{
+		read_pipe_records(prog, stream);
+		return;
+	}
+
+	if (stream->tail != NULL)
+	{
+		read_pipe_tail(prog, stream);
+		return;
+	}
+
+	if (stream->fixed != NULL)
+	{
+		read_pipe_fixed(prog, stream);
+		return;
+	}
+
+	for (;;)
+	{
+		size_t len = stream->buffer.len;
+		size_t size = stream->readSize;
+		ssize_t bytes;
+
+		if (prog->capture
+			&& stream->targetFd == -1
+			&& stream->spillFd == -1
+			&& len + BUFSIZE > stream->limit)
+		{
+			if (!spill_stream(stream))
+			{
+				prog->returnCode = -1;
+				prog->error = errno;
+				stream->eof = true;
+				return;
+			}
+			len = 0;
+		}
+
+		if (prog->capture && stream->targetFd == -1)
+		{
+			size = MIN(size, stream->limit - len);
+		}
+
+		if (stream->targetFd != -1)
+		{
+			bytes = transfer_to_target(stream);
+		}
+		else if (stream->spillFd != -1
+				 && stream->hook == NULL
+				 && stream->canSplice)
+		{
+			bytes = splice_into_spill(stream);
+		}
+		else
+		{
+			bytes = read_into_buf(stream->fd, &(stream->buffer),
+								  size, stream->limit);
+		}
+		stream->reads++;
+
+		if (bytes > 0)
+		{
+			stream->bytes += bytes;
+			adapt_read_size(stream, bytes);
+
+			if (stream->hook != NULL)
+			{
+				(*stream->hook)(prog, stream->buffer.data + len, bytes);
+			}
+
+			/* only keep the preview of data sent to the target */
+			if (stream->targetFd != -1 && stream->buffer.len > stream->preview)
+			{
+				stream->buffer.len = stream->preview;
+				stream->buffer.data[stream->buffer.len] = '\0';
+			}
+
+			if (stream->spillFd != -1 && stream->buffer.len > 0)
+			{
+				if (!write_into_spill(stream,
+									  stream->buffer.data,
+									  stream->buffer.len))
+				{
+					prog->returnCode = -1;
+					prog->error = errno;
+					stream->eof = true;
+					return;
+				}
+			}
+
+			if (!prog->capture || stream->spillFd != -1)
+			{
+				stream->buffer.len = 0;
+				stream->buffer.data[0] = '\0';
+			}
+			continue;
+		}
+		else if (bytes == 0)
+		{
+			stream->eof = true;
+			return;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return;
+		}
+		else if ((stream->spillFd != -1 || stream->targetFd != -1)
+				 && stream->canSplice
+				 && errno == EINVAL)
+		{
+			/* splice() is not supported here, use read() and write() */
+			stream->canSplice = false;
+			continue;
+		}
+		else
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			stream->eof = true;
+			return;
+		}
+	}
+}
+
+
+/*
+ * read_pipe_records is the read_pipe() version for recordOutput: we read
+ * from the pipe directly into the buffer shared by both streams, and add a
+ * record for each chunk. Once recordLimit bytes are kept, we keep reading
+ * from the pipe so that the child isn't blocked, and forget about the data.
+ */
+static void
+read_pipe_records(Program *prog, ProgramStream *stream)
+{
+	PQExpBuffer buffer = &(prog->recordBuffer);
+	size_t limit = MAX_CAPTURE_BUFFER;
+
+	if (prog->recordLimit > 0 && prog->recordLimit < MAX_CAPTURE_BUFFER)
+	{
+		limit = prog->recordLimit;
+	}
+
+	for (;;)
+	{
+		size_t offset = buffer->len;
+		ssize_t bytes;
+
+		if (offset >= limit)
+		{
+			char scratch[BUFSIZE];
+
+			bytes = read(stream->fd, scratch, sizeof(scratch));
+
+			if (bytes > 0)
+			{
+				prog->outputTruncated = true;
+
+				if (stream->hook != NULL)
+				{
+					(*stream->hook)(prog, scratch, bytes);
+				}
+			}
+		}
+		else
+		{
+			/* don't allocate more than the limit for the last read */
+			bytes = read_into_buf(stream->fd, buffer,
+								  MIN(stream->readSize, limit - offset), limit);
+
+			if (bytes > 0)
+			{
+				if (!append_record(prog, stream, offset, bytes))
+				{
+					prog->returnCode = -1;
+					prog->error = ENOMEM;
+					stream->eof = true;
+					return;
+				}
+
+				if (stream->hook != NULL)
+				{
+					(*stream->hook)(prog, buffer->data + offset, bytes);
+				}
+			}
+		}
+		stream->reads++;
+
+		if (bytes > 0)
+		{
+			stream->bytes += bytes;
+			adapt_read_size(stream, bytes);
+			continue;
+		}
+		else if (bytes == 0)
+		{
+			stream->eof = true;
+			return;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return;
+		}
+		else
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			stream->eof = true;
+			return;
+		}
+	}
+}
+
+
+/*
+ * read_pipe_tail reads from the pipe directly into the stream ring buffer,
+ * overwriting the oldest data once the ring is full. Each read() stops at
+ * the end of the ring, so that the hook is given contiguous data.
+ */
+static void
+read_pipe_tail(Program *prog, ProgramStream *stream)
+{
+	for (;;)
+	{
+		char *data = stream->tail + stream->tailPos;
+		size_t count = stream->tailSize - stream->tailPos;
+		ssize_t bytes;
+
+		if (count > stream->readSize)
+		{
+			count = stream->readSize;
+		}
+
+		bytes = read(stream->fd, data, count);
+		stream->reads++;
+
+		if (bytes > 0)
+		{
+			if (stream->hook != NULL)
+			{
+				(*stream->hook)(prog, data, bytes);
+			}
+
+			stream->bytes += bytes;
+			stream->tailPos = (stream->tailPos + bytes) % stream->tailSize;
+			adapt_read_size(stream, bytes);
+			continue;
+		}
+		else if (bytes == 0)
+		{
+			stream->eof = true;
+			return;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return;
+		}
+		else
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			stream->eof = true;
+			return;
+		}
+	}
+}
+
+
+/*
+ * append_tail copies data at the end of the stream ring buffer, for data that
+ * we didn't read into the ring directly.
+ */
+static void
+append_tail(ProgramStream *stream, const char *data, size_t len)
+{
+	/* only the last tailSize bytes would remain anyway */
+	if (len > stream->tailSize)
+	{
+		data += len - stream->tailSize;
+		len = stream->tailSize;
+	}
+
+	while (len > 0)
+	{
+		size_t count = stream->tailSize - stream->tailPos;
+
+		if (count > len)
+		{
+			count = len;
+		}
+
+		memcpy(stream->tail + stream->tailPos, data, count);
+		stream->tailPos = (stream->tailPos + count) % stream->tailSize;
+
+		data += count;
+		len -= count;
+	}
+}
+
+
+/*
+ * read_pipe_fixed reads from the pipe directly into the caller's buffer. Once
+ * the buffer is full we keep reading, so that the child doesn't block, and
+ * only count the bytes and call the hook.
+ */
+static void
+read_pipe_fixed(Program *prog, ProgramStream *stream)
+{
+	for (;;)
+	{
+		char scratch[BUFSIZE];
+		char *data = scratch;
+		size_t count = sizeof(scratch);
+		ssize_t bytes;
+
+		/* keep room for the terminating NUL byte */
+		if (stream->fixedLen + 1 < stream->fixedSize)
+		{
+			data = stream->fixed + stream->fixedLen;
+			count = stream->fixedSize - stream->fixedLen - 1;
+		}
+
+		bytes = read(stream->fd, data, count);
+		stream->reads++;
+
+		if (bytes > 0)
+		{
+			if (data == scratch)
+			{
+				prog->outputTruncated = true;
+			}
+			else
+			{
+				stream->fixedLen += bytes;
+				stream->fixed[stream->fixedLen] = '\0';
+			}
+
+			if (stream->hook != NULL)
+			{
+				(*stream->hook)(prog, data, bytes);
+			}
+
+			stream->bytes += bytes;
+			continue;
+		}
+		else if (bytes == 0)
+		{
+			stream->eof = true;
+			return;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return;
+		}
+		else
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			stream->eof = true;
+			return;
+		}
+	}
+}
+
+
+/*
+ * append_fixed copies data at the end of the caller's buffer, as much of it
+ * as fits there.
+ */
+static void
+append_fixed(Program *prog, ProgramStream *stream,
+			 const char *data, size_t len)
+{
+	size_t room = stream->fixedSize - stream->fixedLen - 1;
+
+	if (len > room)
+	{
+		prog->outputTruncated = true;
+		len = room;
+	}
+
+	memcpy(stream->fixed + stream->fixedLen, data, len);
+	stream->fixedLen += len;
+	stream->fixed[stream->fixedLen] = '\0';
+}
+
+
+/*
+ * process_stream_data processes a chunk of data that we didn't read from the
+ * pipe ourselves, the kernel read it for us in a ring buffer or a builtin
+ * produced it, the same way read_pipe() does: call the hook, capture the data
+ * in memory, and move it to a spill file past the memory limit.
+ */
+static void
+process_stream_data(Program *prog, ProgramStream *stream,
+					const char *data, size_t len)
+{
+	size_t previous;
+
+	stream->bytes += len;
+
+	if (stream->tail != NULL)
+	{
+		if (stream->hook != NULL)
+		{
+			(*stream->hook)(prog, data, len);
+		}
+		append_tail(stream, data, len);
+		return;
+	}
+
+	if (stream->fixed != NULL)
+	{
+		if (stream->hook != NULL)
+		{
+			(*stream->hook)(prog, data, len);
+		}
+		append_fixed(prog, stream, data, len);
+		return;
+	}
+
+	if (prog->capture
+		&& stream->spillFd == -1
+		&& stream->buffer.len + len > stream->limit)
+	{
+		if (!spill_stream(stream))
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+			return;
+		}
+	}
+
+	previous = stream->buffer.len;
+	appendBinaryPQExpBuffer(&(stream->buffer), data, len);
+
+	if (PQExpBufferBroken(&(stream->buffer)))
+	{
+		prog->returnCode = -1;
+		prog->error = ENOMEM;
+		return;
+	}
+
+	if (stream->hook != NULL)
+	{
+		(*stream->hook)(prog, stream->buffer.data + previous, len);
+	}
+
+	if (stream->spillFd != -1)
+	{
+		if (!write_into_spill(stream, stream->buffer.data, stream->buffer.len))
+		{
+			prog->returnCode = -1;
+			prog->error = errno;
+		}
+	}
+
+	if (!prog->capture || stream->spillFd != -1)
+	{
+		stream->buffer.len = 0;
+		stream->buffer.data[0] = '\0';
+	}
+}
+
+
+/*
+ * append_record adds a record for a chunk of the given stream that we just
+ * read at offset in the record buffer. When the previous record is for the
+ * same stream and we read it in the same millisecond, we extend it instead,
+ * which keeps the records compact for fast producers.
+ */
+static bool
+append_record(Program *prog, ProgramStream *stream, size_t offset, size_t len)
+{
+	uint32_t streamId = stream == &(prog->out) ? STDOUT_FILENO : STDERR_FILENO;
+	uint64_t usecs = monotonic_usecs() - prog->startTime;
+	ProgramRecord *last = NULL;
+
+	if (prog->recordCount > 0)
+	{
+		last = &(prog->records[prog->recordCount - 1]);
+	}
+
+	if (last != NULL
+		&& last->stream == streamId
+		&& last->offset + last->len == offset
+		&& usecs - last->usecs < 1000
+		&& (uint64_t) last->len + len <= UINT32_MAX)
+	{
+		last->len += len;
+		return true;
+	}
+
+	if (prog->recordCount == prog->recordSize)
+	{
+		int size = MAX(64, prog->recordSize * 2);
+		ProgramRecord *records =
+			(ProgramRecord *) realloc(prog->records,
+									  size * sizeof(ProgramRecord));
+
+		if (records == NULL)
+		{
+			return false;
+		}
+		prog->records = records;
+		prog->recordSize = size;
+	}
+
+	last = &(prog->records[prog->recordCount++]);
+	last->usecs = usecs;
+	last->offset = offset;
+	last->len = len;
+	last->stream = streamId;
+
+	return true;
+}
+
+
+/*
+ * Read from a file descriptor directly into the spare capacity at the end of
+ * our buffer, so that the data is copied only once, by the kernel. The buffer
+ * is enlarged first when less than size bytes are available, and never holds
+ * more than limit bytes.
+ */
+static ssize_t
+read_into_buf(int filedes, PQExpBuffer buffer, size_t size, size_t limit)
+{
+	ssize_t bytes;
+	size_t count;
+
+	if (!enlargePQExpBuffer(buffer, size))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* keep room for the terminating NUL byte */
+	count = buffer->maxlen - buffer->len - 1;
+
+	if (buffer->len + count > limit)
+	{
+		count = limit - buffer->len;
+	}
+
+	bytes = read(filedes, buffer->data + buffer->len, count);
+
+	if (bytes > 0)
+	{
+		buffer->len += bytes;
+		buffer->data[buffer->len] = '\0';
+	}
+	return bytes;
+}
+
+
+/*
+ * adapt_read_size grows the read size of a stream when a read filled it, and
+ * the pipe capacity when a read emptied a full pipe: the child is then
+ * producing data faster than we read it. Bulk transfers end-up using large
+ * reads and pipes, while slow children keep using small ones.
+ */
+static void
+adapt_read_size(ProgramStream *stream, ssize_t bytes)
+{
+	if ((size_t) bytes >= stream->readSize
+		&& stream->readSize < stream->maxReadSize)
+	{
+		stream->readSize = stream->readSize * 2 > stream->maxReadSize
+			? stream->maxReadSize
+			: stream->readSize * 2;
+	}
+
+#ifdef F_SETPIPE_SZ
+	if (stream->pipeSize > 0
+		&& bytes >= stream->pipeSize
+		&& stream->pipeSize < stream->maxPipeSize)
+	{
+		int size = stream->pipeSize * 4 > stream->maxPipeSize
+			? stream->maxPipeSize
+			: stream->pipeSize * 4;
+		int newSize = fcntl(stream->fd, F_SETPIPE_SZ, size);
+
+		if (newSize > 0)
+		{
+			stream->pipeSize = newSize;
+		}
+		else
+		{
+			/* e.g. EPERM past /proc/sys/fs/pipe-max-size, stop trying */
+			stream->maxPipeSize = stream->pipeSize;
+		}
+	}
+#endif
+}
+
+
+/*
+ * spill_stream creates the file where to write the stream data past its
+ * limit, and moves the data we have in memory already to that file. We use an
+ * anonymous memfd when possible, and an unlinked temporary file otherwise.
+ */
+static bool
+spill_stream(ProgramStream *stream)
+{
+#ifdef MFD_CLOEXEC
+	stream->spillFd = memfd_create("runprogram", MFD_CLOEXEC);
+#endif
+
+	if (stream->spillFd == -1)
+	{
+		FILE *file = tmpfile();
+
+		if (file == NULL)
+		{
+			return false;
+		}
+
+		stream->spillFd = fcntl(fileno(file), F_DUPFD_CLOEXEC, 0);
+		fclose(file);
+
+		if (stream->spillFd == -1)
+		{
+			return false;
+		}
+	}
+
+	if (!write_into_spill(stream, stream->buffer.data, stream->buffer.len))
+	{
+		return false;
+	}
+
+	stream->buffer.len = 0;
+	stream->buffer.data[0] = '\0';
+
+	return true;
+}
+
+
+/*
+ * splice_into_spill moves data from the stream pipe to its spill file within
+ * the kernel. Returns like read(2) does.
+ */
+static ssize_t
+splice_into_spill(ProgramStream *stream)
+{
+	ssize_t bytes = splice(stream->fd, NULL, stream->spillFd, NULL,
+						   MAX_CAPTURE_BUFFER,
+						   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if (bytes > 0)
+	{
+		stream->spilled += bytes;
+	}
+	return bytes;
+}
+
+
+/*
+ * write_into_spill writes len bytes of data to the stream spill file.
+ */
+static bool
+write_into_spill(ProgramStream *stream, const char *data, size_t len)
+{
+	if (!write_fully(stream->spillFd, data, len))
+	{
+		return false;
+	}
+	stream->spilled += len;
+
+	return true;
+}
+
+
+/*
+ * transfer_to_target moves data from the stream pipe to its target file
+ * descriptor, and returns like read(2) does.
+ *
+ * With splice() the data never goes through user space. While we still need
+ * some preview, the data is first tee()d into the preview pipe and then
+ * read from there into our buffer. When a hook needs to see the data, or
+ * splice() isn't supported for the target, we read() and write() instead.
+ */
+static ssize_t
+transfer_to_target(ProgramStream *stream)
+{
+	if (stream->hook != NULL || !stream->canSplice)
+	{
+		size_t len = stream->buffer.len;
+		ssize_t bytes = read_into_buf(stream->fd, &(stream->buffer),
+									  stream->readSize, MAX_CAPTURE_BUFFER);
+
+		if (bytes > 0
+			&& !write_fully(stream->targetFd, stream->buffer.data + len, bytes))
+		{
+			return -1;
+		}
+		return bytes;
+	}
+
+	if (stream->previewPipe[1] != -1 && stream->buffer.len < stream->preview)
+	{
+		ssize_t bytes = tee(stream->fd, stream->previewPipe[1],
+							stream->preview - stream->buffer.len,
+							SPLICE_F_NONBLOCK);
+
+		if (bytes <= 0)
+		{
+			return bytes;
+		}
+
+		/* the data is in the pipe already, so the splice() can't block */
+		for (ssize_t moved = 0; moved < bytes;)
+		{
+			ssize_t n = splice(stream->fd, NULL, stream->targetFd, NULL,
+							   bytes - moved, SPLICE_F_MOVE);
+
+			if (n == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			else if (n <= 0)
+			{
+				errno = n == 0 ? EPIPE : errno;
+				return -1;
+			}
+			moved += n;
+		}
+
+		if (!tee_preview(stream, bytes))
+		{
+			return -1;
+		}
+		return bytes;
+	}
+
+	return splice(stream->fd, NULL, stream->targetFd, NULL,
+				  stream->readSize, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+
+/*
+ * tee_preview reads len bytes that we tee()d into the preview pipe and
+ * appends them to the stream buffer.
+ */
+static bool
+tee_preview(ProgramStream *stream, size_t len)
+{
+	PQExpBuffer buffer = &(stream->buffer);
+
+	if (!enlargePQExpBuffer(buffer, len))
+	{
+		errno = ENOMEM;
+		return false;
+	}
+
+	while (len > 0)
+	{
+		ssize_t bytes = read(stream->previewPipe[0],
+							 buffer->data + buffer->len, len);
+
+		if (bytes == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		buffer->len += bytes;
+		len -= bytes;
+	}
+	buffer->data[buffer->len] = '\0';
+
+	return true;
+}
+
+
+/*
+ * write_fully writes len bytes of data to the given file descriptor, looping
+ * over partial writes.
+ */
+static bool
+write_fully(int filedes, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t bytes = write(filedes, data, len);
+
+		if (bytes == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += bytes;
+		len -= bytes;
+	}
+	return true;
+}
+
+
+/*
+ * take_stream_data returns the data we captured for the given stream and sets
+ * len to its length, like take_buffer_data does. When the stream has been
+ * spilled to a file, the file is mapped in memory read-only and spillFd is
+ * set, the caller then owns the mapping and the file descriptor.
+ *
+ * The file is grown by one zero byte, so that the mapping is NUL terminated.
+ */
+static char *
+take_stream_data(Program *prog, ProgramStream *stream,
+				 size_t *len, int *spillFd)
+{
+	void *data;
+
+	*spillFd = -1;
+
+	if (stream->tail != NULL)
+	{
+		termPQExpBuffer(&(stream->buffer));
+		return take_tail_data(stream, len);
+	}
+
+	if (stream->fixed != NULL)
+	{
+		*len = stream->fixedLen;
+		return stream->fixed;
+	}
+
+	if (stream->spillFd == -1)
+	{
+		return take_buffer_data(&(stream->buffer), len);
+	}
+
+	termPQExpBuffer(&(stream->buffer));
+
+	*len = stream->spilled;
+
+	if (ftruncate(stream->spillFd, stream->spilled + 1) == -1
+		|| (data = mmap(NULL, stream->spilled + 1, PROT_READ, MAP_SHARED,
+						stream->spillFd, 0)) == MAP_FAILED)
+	{
+		prog->returnCode = -1;
+		prog->error = errno;
+
+		close(stream->spillFd);
+		*len = 0;
+		return NULL;
+	}
+
+	*spillFd = stream->spillFd;
+
+	return (char *) data;
+}
+
+
+/*
+ * take_buffer_data returns the malloc'ed data of the given buffer, which the
+ * caller now owns, and sets len to the length of the data. An empty buffer
+ * is released and NULL is returned instead.
+ */
+static char *
+take_buffer_data(PQExpBuffer buffer, size_t *len)
+{
+	*len = 0;
+
+	if (PQExpBufferBroken(buffer) || buffer->len == 0)
+	{
+		termPQExpBuffer(buffer);
+		return NULL;
+	}
+
+	*len = buffer->len;
+
+	return buffer->data;
+}
+
+
+/*
+ * take_tail_data returns a malloc'ed copy of the last tailKeep bytes in the
+ * stream ring buffer, in order, and releases the ring.
+ */
+static char *
+take_tail_data(ProgramStream *stream, size_t *len)
+{
+	size_t keep = stream->bytes < stream->tailKeep
+		? stream->bytes
+		: stream->tailKeep;
+	size_t start = (stream->tailPos + stream->tailSize - keep) % stream->tailSize;
+	size_t first = stream->tailSize - start;
+	char *data = NULL;
+
+	*len = 0;
+
+	if (keep > 0 && (data = (char *) malloc(keep + 1)) != NULL)
+	{
+		if (first >= keep)
+		{
+			memcpy(data, stream->tail + start, keep);
+		}
+		else
+		{
+			memcpy(data, stream->tail + start, first);
+			memcpy(data + first, stream->tail, keep - first);
+		}
+		data[keep] = '\0';
+		*len = keep;
+	}
+
+	free(stream->tail);
+	stream->tail = NULL;
+
+	return data;
+}
+
+
+/*
+ * close_pipe closes both ends of a pipe, when it has been created.
+ */
+static void
+close_pipe(int *pipefd)
+{
+	if (pipefd[0] != -1)
+	{
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+}
+
+
+/*
+ * child_stdio_sources sets sources to the descriptors that the child gets as
+ * its stdin, stdout and stderr: our pipes, or the caller's descriptors. The
+ * stdin source is -1 when the child reads from /dev/null.
+ */
+static void
+child_stdio_sources(Program *prog, int *inpipe, int *outpipe, int *errpipe,
+					int *sources)
+{
+	sources[STDIN_FILENO] = inpipe[0] != -1 ? inpipe[0] : prog->stdinFd;
+
+	sources[STDOUT_FILENO] =
+		program_redirects(prog, prog->stdoutFd, prog->stdoutHook)
+		? prog->stdoutFd : outpipe[1];
+
+	sources[STDERR_FILENO] =
+		program_redirects(prog, prog->stderrFd, prog->stderrHook)
+		? prog->stderrFd : errpipe[1];
+}
+
+
+/*
+ * dup_above_stderr returns a close-on-exec copy of filedes above our
+ * standard streams when it is one of them, and filedes otherwise. The child
+ * can then install its stdin, stdout and stderr in any order, as a shell
+ * does for "2>&1". Returns -1 with errno set when fcntl() fails.
+ */
+static int
+dup_above_stderr(int filedes)
+{
+	if (filedes < 0 || filedes > STDERR_FILENO)
+	{
+		return filedes;
+	}
+	return fcntl(filedes, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+}
+
+
+/*
+ * close_stdio_copies closes the first count copies that dup_above_stderr()
+ * made of the sources.
+ */
+static void
+close_stdio_copies(int *sources, int *copies, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (copies[i] != sources[i] && copies[i] != -1)
+		{
+			close(copies[i]);
+		}
+	}
+}
+
+
+/*
+ * redirect_fd makes target a copy of filedes in the child process, without
+ * the close-on-exec flag. When filedes already is target, which happens when
+ * our own standard streams were closed, dup2() would do nothing.
+ */
+static void
+redirect_fd(int filedes, int target)
+{
+	if (filedes == target)
+	{
+		(void) fcntl(filedes, F_SETFD, 0);
+	}
+	else
+	{
+		(void) dup2(filedes, target);
+	}
+}
+
+
+/*
+ * set_cloexec_from sets the close-on-exec flag on all our descriptors from
+ * lowfd, in the child process between fork() and exec(). We use a single
+ * close_range() call when the kernel supports it (Linux 5.11), and otherwise
+ * list the descriptors in /proc/self/fd, with getdents64() directly, because
+ * opendir() allocates memory, which isn't safe after fork(). As a last
+ * resort, we loop over all the possible descriptor numbers.
+ */
+static void
+set_cloexec_from(int lowfd)
+{
+	long maxfd;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, lowfd, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+	{
+		return;
+	}
+#endif
+
+#ifdef SYS_getdents64
+	{
+		int dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+		if (dirfd != -1)
+		{
+			char buf[4096];
+			long bytes;
+
+			while ((bytes = syscall(SYS_getdents64,
+									dirfd, buf, sizeof(buf))) > 0)
+			{
+				for (long pos = 0; pos < bytes;)
+				{
+					struct dirent64 *entry = (struct dirent64 *) (buf + pos);
+					char *ptr = entry->d_name;
+					int filedes = 0;
+
+					pos += entry->d_reclen;
+
+					/* skip "." and ".." */
+					if (*ptr < '0' || *ptr > '9')
+					{
+						continue;
+					}
+
+					for (; *ptr >= '0' && *ptr <= '9'; ptr++)
+					{
+						filedes = filedes * 10 + (*ptr - '0');
+					}
+
+					if (filedes >= lowfd && filedes != dirfd)
+					{
+						(void) fcntl(filedes, F_SETFD, FD_CLOEXEC);
+					}
+				}
+			}
+			close(dirfd);
+
+			if (bytes == 0)
+			{
+				return;
+			}
+		}
+	}
+#endif
+
+	maxfd = sysconf(_SC_OPEN_MAX);
+
+	for (int filedes = lowfd; filedes < maxfd; filedes++)
+	{
+		(void) fcntl(filedes, F_SETFD, FD_CLOEXEC);
+	}
+}
+
+
+/*
+ * Sets the O_NONBLOCK flag on the given file descriptor.
+ */
+static bool
+set_nonblocking(int filedes)
+{
+	int flags = fcntl(filedes, F_GETFL);
+
+	if (flags == -1)
+	{
+		return false;
+	}
+	return fcntl(filedes, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+
+/*
+ * program_read_throughput returns how many MB per second we read from the
+ * child pipes, over its whole run time.
+ */
+double
+program_read_throughput(Program *prog)
+{
+	if (prog->elapsedMs <= 0)
+	{
+		return 0;
+	}
+	return (prog->bytesRead / (1024.0 * 1024.0)) / (prog->elapsedMs / 1000.0);
+}
+
+
+/*
+ * init_record_iterator prepares to replay the output of a program that ran
+ * with recordOutput, using record_iterator_next():
+ *
+ *   ProgramRecordIterator iter;
+ *
+ *   init_record_iterator(&iter, &prog);
+ *
+ *   while (record_iterator_next(&iter))
+ *   {
+ *       fwrite(iter.data, 1, iter.len,
+ *              iter.stream == STDOUT_FILENO ? stdout : stderr);
+ *   }
+ */
+void
+init_record_iterator(ProgramRecordIterator *iter, Program *prog)
+{
+	iter->prog = prog;
+	iter->next = 0;
+	iter->stream = -1;
+	iter->usecs = 0;
+	iter->data = NULL;
+	iter->len = 0;
+}
+
+
+/*
+ * record_iterator_next moves to the next record, and returns false when there
+ * are no more records. The data points into prog->output, it's not copied.
+ */
+bool
+record_iterator_next(ProgramRecordIterator *iter)
+{
+	Program *prog = iter->prog;
+	ProgramRecord *record;
+
+	if (iter->next >= prog->recordCount || prog->output == NULL)
+	{
+		return false;
+	}
+
+	record = &(prog->records[iter->next++]);
+
+	iter->stream = record->stream;
+	iter->usecs = record->usecs;
+	iter->data = prog->output + record->offset;
+	iter->len = record->len;
+
+	return true;
+}
+
+/*
+ * init_line_iterator prepares to iterate over the lines in data, such as the
+ * output of a program:
+ *
+ *   ProgramLineIterator iter;
+ *
+ *   init_line_iterator(&iter, prog.stdout, prog.stdout_len);
+ *
+ *   while (line_iterator_next(&iter))
+ *   {
+ *       printf("%.*s\n", (int) iter.len, iter.line);
+ *   }
+ *
+ * We look for newlines with memchr(), which the C library implements with
+ * vector instructions, so that we scan large outputs at memory speed.
+ */
+void
+init_line_iterator(ProgramLineIterator *iter, const char *data, size_t len)
+{
+	iter->next = data;
+	iter->end = data == NULL ? NULL : data + len;
+	iter->line = NULL;
+	iter->len = 0;
+}
+
+
+/*
+ * line_iterator_next moves to the next line, and returns false when there are
+ * no more lines. A last line without a newline is still a line.
+ */
+bool
+line_iterator_next(ProgramLineIterator *iter)
+{
+	const char *eol;
+
+	if (iter->next == NULL || iter->next >= iter->end)
+	{
+		return false;
+	}
+
+	eol = memchr(iter->next, '\n', iter->end - iter->next);
+
+	iter->line = iter->next;
+	iter->len = (eol == NULL ? iter->end : eol) - iter->next;
+	iter->next = eol == NULL ? iter->end : eol + 1;
+
+	return true;
+}
+
+
+/*
+ * init_field_iterator prepares to iterate over the fields of a line that are
+ * separated with the delimiter. As with the usual split functions, "a::b"
+ * has an empty field in the middle, and an empty line has a single empty
+ * field.
+ */
+void
+init_field_iterator(ProgramFieldIterator *iter,
+					const char *data, size_t len, char delimiter)
+{
+	iter->next = data;
+	iter->end = data + len;
+	iter->delimiter = delimiter;
+	iter->done = false;
+	iter->field = NULL;
+	iter->len = 0;
+}
+
+
+/*
+ * field_iterator_next moves to the next field, and returns false when there
+ * are no more fields.
+ */
+bool
+field_iterator_next(ProgramFieldIterator *iter)
+{
+	const char *sep;
+
+	if (iter->done)
+	{
+		return false;
+	}
+
+	sep = iter->next < iter->end
+		? memchr(iter->next, iter->delimiter, iter->end - iter->next)
+		: NULL;
+
+	iter->field = iter->next;
+
+	if (sep == NULL)
+	{
+		iter->len = iter->end - iter->next;
+		iter->next = iter->end;
+		iter->done = true;
+	}
+	else
+	{
+		iter->len = sep - iter->next;
+		iter->next = sep + 1;
+	}
+
+	return true;
+}
+
+
+/*
+ * io_uring read method.
+ */
+
+/*
+ * program_uses_ring returns true when we can read from the child pipes with
+ * io_uring: when asked to, when the program only needs its pipes read and its
+ * exit waited for, and when the system supports it.
+ */
+static bool
+program_uses_ring(Program *prog)
+{
+	return prog->readMethod == PROGRAM_READ_IO_URING
+		&& prog->timeoutMs <= 0
+		&& prog->stdinPipe == -1
+		&& prog->out.targetFd == -1
+		&& prog->err.targetFd == -1
+		&& !prog->recordOutput
+		&& program_ring_available();
+}
+
+
+/*
+ * program_ring_available sets up our io_uring instance when needed, and
+ * returns true when it's usable. Once we know that io_uring, multishot reads,
+ * or waitid are not supported, we don't try again.
+ */
+bool
+program_ring_available()
+{
+#ifdef HAVE_IO_URING
+	ProgramRing *ring = &programRing;
+
+	if (ring->fd != -1)
+	{
+		return true;
+	}
+
+	if (ring->unavailable)
+	{
+		return false;
+	}
+
+	if (!setup_program_ring(ring))
+	{
+		free_program_ring(ring);
+		ring->unavailable = true;
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+#ifdef HAVE_IO_URING
+
+/*
+ * read_from_ring is the io_uring version of read_from_pipes(). We post a
+ * multishot read on each pipe, that completes each time the kernel filled one
+ * of our provided buffers, and a waitid that completes when the child exits.
+ * Then we loop on io_uring_enter() until we're done, which submits the new
+ * requests and waits for completions in the same system call.
+ *
+ * We use WNOWAIT so that finish_program() still reaps the child with wait4()
+ * and gets its resource usage.
+ */
+static void
+read_from_ring(Program *prog)
+{
+	ProgramRing *ring = &programRing;
+	siginfo_t info;
+	bool exited = false;
+
+	ring_read_multishot(ring, prog->out.fd, RING_DATA_STDOUT);
+	ring_read_multishot(ring, prog->err.fd, RING_DATA_STDERR);
+	ring_waitid(ring, prog->pid, &info);
+
+	while (!(prog->out.eof && prog->err.eof && exited))
+	{
+		unsigned head, tail;
+		int ret;
+
+		/* the kernel reads the new entries once it sees the new tail */
+		__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+		ret = syscall(SYS_io_uring_enter, ring->fd, ring->toSubmit, 1,
+					  IORING_ENTER_GETEVENTS, NULL, 0);
+
+		prog->waitCalls++;
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			/* closing the ring cancels our requests, we'll set up again */
+			prog->returnCode = -1;
+			prog->error = errno;
+			prog->out.eof = prog->err.eof = true;
+
+			free_program_ring(ring);
+			break;
+		}
+		ring->toSubmit -= ret;
+
+		head = *ring->cqHead;
+		tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &(ring->cqes[head & ring->cqMask]);
+
+			(void) ring_handle_completion(prog, cqe, &exited);
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	finish_program(prog);
+
+	return;
+}
+
+
+/*
+ * ring_handle_completion processes a completion of one of our requests, and
+ * posts the request again when it's not done yet. Returns false when the
+ * request failed.
+ */
+static bool
+ring_handle_completion(Program *prog, struct io_uring_cqe *cqe, bool *exited)
+{
+	ProgramRing *ring = &programRing;
+	ProgramStream *stream;
+
+	if (cqe->user_data == RING_DATA_WAITID)
+	{
+		/* on error, wait4() in finish_program() still waits for the child */
+		*exited = true;
+		return cqe->res == 0;
+	}
+
+	stream = cqe->user_data == RING_DATA_STDOUT ? &(prog->out) : &(prog->err);
+
+	if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+	{
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		process_stream_data(prog, stream,
+							ring->buffers + (size_t) bid * RING_BUFFER_SIZE,
+							cqe->res);
+
+		/* the kernel may fill that buffer again */
+		ring_provide_buffer(ring, bid);
+	}
+	else if (cqe->res == 0)
+	{
+		stream->eof = true;
+		return true;
+	}
+	else if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -EAGAIN)
+	{
+		prog->returnCode = -1;
+		prog->error = -cqe->res;
+		stream->eof = true;
+		return false;
+	}
+
+	/* post the read again when the kernel ended the multishot request */
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !stream->eof)
+	{
+		ring_read_multishot(ring, stream->fd, cqe->user_data);
+	}
+	return true;
+}
+
+
+/*
+ * setup_program_ring creates the io_uring instance, maps its rings, checks
+ * that the kernel supports the opcodes we need, and registers our provided
+ * buffers ring. Returns false when anything is missing.
+ */
+static bool
+setup_program_ring(ProgramRing *ring)
+{
+	struct io_uring_params params = { 0 };
+	struct io_uring_probe *probe;
+	struct io_uring_buf_reg reg = { 0 };
+	size_t probeSize;
+	bool supported;
+	unsigned *sqArray;
+
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = RING_CQ_ENTRIES;
+
+	ring->fd = (int) syscall(SYS_io_uring_setup, RING_ENTRIES, &params);
+
+	if (ring->fd == -1)
+	{
+		return false;
+	}
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->sqRingSize = ring->cqRingSize =
+			MAX(ring->sqRingSize, ring->cqRingSize);
+	}
+
+	ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+	if (ring->sqRing == MAP_FAILED)
+	{
+		ring->sqRing = NULL;
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cqRing = ring->sqRing;
+	}
+	else
+	{
+		ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE,
+							ring->fd, IORING_OFF_CQ_RING);
+
+		if (ring->cqRing == MAP_FAILED)
+		{
+			ring->cqRing = NULL;
+			return false;
+		}
+	}
+
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED)
+	{
+		ring->sqes = NULL;
+		return false;
+	}
+
+	ring->sqTail = (unsigned *) ((char *) ring->sqRing + params.sq_off.tail);
+	ring->sqMask = *(unsigned *) ((char *) ring->sqRing
+								  + params.sq_off.ring_mask);
+	ring->cqHead = (unsigned *) ((char *) ring->cqRing + params.cq_off.head);
+	ring->cqTail = (unsigned *) ((char *) ring->cqRing + params.cq_off.tail);
+	ring->cqMask = *(unsigned *) ((char *) ring->cqRing
+								  + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqRing
+										  + params.cq_off.cqes);
+	ring->sqLocalTail = *ring->sqTail;
+	ring->toSubmit = 0;
+
+	/* submission queue entries are always used in order */
+	sqArray = (unsigned *) ((char *) ring->sqRing + params.sq_off.array);
+
+	for (unsigned i = 0; i < params.sq_entries; i++)
+	{
+		sqArray[i] = i;
+	}
+
+	/* check that the kernel knows about multishot reads and waitid */
+	probeSize = sizeof(struct io_uring_probe)
+		+ 256 * sizeof(struct io_uring_probe_op);
+	probe = (struct io_uring_probe *) calloc(1, probeSize);
+
+	if (probe == NULL)
+	{
+		return false;
+	}
+
+	supported =
+		syscall(SYS_io_uring_register, ring->fd,
+				IORING_REGISTER_PROBE, probe, 256) == 0
+		&& probe->last_op >= RING_OP_WAITID
+		&& (probe->ops[RING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED)
+		&& (probe->ops[RING_OP_WAITID].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+
+	if (!supported)
+	{
+		return false;
+	}
+
+	/* register the ring of provided buffers, and give all of them */
+	ring->bufRingSize = RING_BUFFERS * sizeof(struct io_uring_buf);
+	ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (ring->bufRing == MAP_FAILED)
+	{
+		ring->bufRing = NULL;
+		return false;
+	}
+
+	ring->buffers = (char *) malloc((size_t) RING_BUFFERS * RING_BUFFER_SIZE);
+
+	if (ring->buffers == NULL)
+	{
+		return false;
+	}
+
+	reg.ring_addr = (uint64_t) (uintptr_t) ring->bufRing;
+	reg.ring_entries = RING_BUFFERS;
+	reg.bgid = RING_BUFFER_GROUP;
+
+	if (syscall(SYS_io_uring_register, ring->fd,
+				IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+	{
+		return false;
+	}
+
+	for (unsigned short bid = 0; bid < RING_BUFFERS; bid++)
+	{
+		ring_provide_buffer(ring, bid);
+	}
+
+	return true;
+}
+
+
+/*
+ * free_program_ring releases our io_uring instance, which the kernel cancels
+ * the pending requests of.
+ */
+static void
+free_program_ring(ProgramRing *ring)
+{
+	if (ring->sqes != NULL)
+	{
+		munmap(ring->sqes, ring->sqesSize);
+	}
+
+	if (ring->cqRing != NULL && ring->cqRing != ring->sqRing)
+	{
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+
+	if (ring->sqRing != NULL)
+	{
+		munmap(ring->sqRing, ring->sqRingSize);
+	}
+
+	if (ring->fd != -1)
+	{
+		close(ring->fd);
+	}
+
+	if (ring->bufRing != NULL)
+	{
+		munmap(ring->bufRing, ring->bufRingSize);
+	}
+
+	free(ring->buffers);
+
+	memset(ring, 0, sizeof(ProgramRing));
+	ring->fd = -1;
+}
+
+
+/*
+ * ring_get_sqe returns the next submission queue entry, zeroed, and counts it
+ * for the next io_uring_enter() call. We never have more requests in flight
+ * than the queue size: two reads and a waitid.
+ */
+static struct io_uring_sqe *
+ring_get_sqe(ProgramRing *ring)
+{
+	struct io_uring_sqe *sqe =
+		&(ring->sqes[ring->sqLocalTail++ & ring->sqMask]);
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->toSubmit++;
+
+	return sqe;
+}
+
+
+/*
+ * ring_provide_buffer gives the buffer bid back to the kernel.
+ */
+static void
+ring_provide_buffer(ProgramRing *ring, unsigned short bid)
+{
+	unsigned short tail = ring->bufRing->tail;
+	struct io_uring_buf *buf = &(ring->bufRing->bufs[tail & (RING_BUFFERS - 1)]);
+
+	buf->addr = (uint64_t) (uintptr_t) (ring->buffers
+										+ (size_t) bid * RING_BUFFER_SIZE);
+	buf->len = RING_BUFFER_SIZE;
+	buf->bid = bid;
+
+	__atomic_store_n(&(ring->bufRing->tail), tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * ring_read_multishot posts a read request on filedes that completes each
+ * time data is available, in one of the provided buffers.
+ */
+static void
+ring_read_multishot(ProgramRing *ring, int filedes, uint64_t data)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+	sqe->opcode = RING_OP_READ_MULTISHOT;
+	sqe->fd = filedes;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RING_BUFFER_GROUP;
+	sqe->user_data = data;
+}
+
+
+/*
+ * ring_waitid posts a waitid(P_PID, pid, info, WEXITED | WNOWAIT) request.
+ */
+static void
+ring_waitid(ProgramRing *ring, pid_t pid, siginfo_t *info)
+{
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+	sqe->opcode = RING_OP_WAITID;
+	sqe->fd = pid;
+	sqe->len = P_PID;
+	sqe->addr2 = (uint64_t) (uintptr_t) info;
+	sqe->file_index = WEXITED | WNOWAIT;
+	sqe->user_data = RING_DATA_WAITID;
+}
+
+#endif  /* HAVE_IO_URING */
+
+
+/*
+ * Command templates.
+ */
+
+/*
+ * compile_command prepares a CommandTemplate from the given arguments, where
+ * each argument that is COMMAND_SLOT is a slot for a value to be given when
+ * running the command. We open the executable and copy the environment now.
+ * The returned template prog slot settings apply to each run.
+ *
+ * Returns NULL with errno set when the program can't be opened, or ENOMEM
+ * when we're out of memory.
+ */
+CommandTemplate *
+compile_command(char **args)
+{
+	CommandTemplate *cmd = (CommandTemplate *) malloc(sizeof(CommandTemplate));
+	int nbEnv = 0;
+
+	if (cmd == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cmd->prog = initialize_program(args, false);
+	cmd->nbArgs = 0;
+	cmd->nbSlots = 0;
+	cmd->slots = NULL;
+
+	for (int i = 0; args[i] != NULL; i++)
+	{
+		cmd->nbArgs++;
+
+		if (i > 0 && strcmp(args[i], COMMAND_SLOT) == 0)
+		{
+			cmd->nbSlots++;
+		}
+	}
+
+	cmd->slots = (int *) malloc(MAX(cmd->nbSlots, 1) * sizeof(int));
+
+	if (cmd->slots == NULL)
+	{
+		free_command(cmd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (int i = 0, slot = 0; args[i] != NULL; i++)
+	{
+		if (i > 0 && strcmp(args[i], COMMAND_SLOT) == 0)
+		{
+			cmd->slots[slot++] = i;
+
+			/* slots point to the caller's values, and are NULL otherwise */
+			free(cmd->prog.args[i]);
+			cmd->prog.args[i] = NULL;
+		}
+	}
+
+	/* take a copy of the environment, which may change later */
+	for (char **env = environ; *env != NULL; env++)
+	{
+		nbEnv++;
+	}
+
+	cmd->prog.envp = (char **) malloc((nbEnv + 1) * sizeof(char *));
+
+	if (cmd->prog.envp == NULL)
+	{
+		free_command(cmd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (int i = 0; i <= nbEnv; i++)
+	{
+		cmd->prog.envp[i] = i < nbEnv ? strdup(environ[i]) : NULL;
+
+		/* the NULL entry ends the array for free_command() */
+		if (i < nbEnv && cmd->prog.envp[i] == NULL)
+		{
+			free_command(cmd);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	cmd->prog.execFd = open(cmd->prog.program, O_RDONLY | O_CLOEXEC);
+
+	if (cmd->prog.execFd == -1)
+	{
+		int err = errno;
+
+		free_command(cmd);
+		errno = err;
+		return NULL;
+	}
+
+	return cmd;
+}
+
+
+/*
+ * run_command runs the given command template with values for its slots,
+ * which must have cmd->nbSlots entries, and returns the Program result, to be
+ * released with free_program() as usual.
+ *
+ * The values are used in place, the argv array of the template is re-used,
+ * and the executable is run with fexecve(): preparing the child process
+ * allocates no memory. With PROGRAM_SPAWN_POSIX_SPAWN we still fork(), as
+ * posix_spawn() can only run a path, which may have changed since then.
+ *
+ * The returned program and args point to the template, where the slots are
+ * NULL again, so they are only valid as long as the template is.
+ */
+Program
+run_command(CommandTemplate *cmd, char **values)
+{
+	Program prog = cmd->prog;
+
+	for (int i = 0; i < cmd->nbSlots; i++)
+	{
+		prog.args[cmd->slots[i]] = values[i];
+	}
+	prog.sharedArgs = true;
+
+	execute_program(&prog);
+
+	/* don't keep pointers to the caller's values */
+	for (int i = 0; i < cmd->nbSlots; i++)
+	{
+		prog.args[cmd->slots[i]] = NULL;
+	}
+
+	return prog;
+}
+
+
+/*
+ * free_command releases the memory and the file descriptor of a command
+ * template.
+ */
+void
+free_command(CommandTemplate *cmd)
+{
+	Program *prog = &(cmd->prog);
+
+	if (prog->execFd != -1)
+	{
+		close(prog->execFd);
+	}
+
+	/* we may be unwinding a failed compile_command() */
+	if (prog->envp != NULL)
+	{
+		for (int i = 0; prog->envp[i] != NULL; i++)
+		{
+			free(prog->envp[i]);
+		}
+		free(prog->envp);
+	}
+
+	if (prog->ownsProgram)
+	{
+		free(prog->program);
+	}
+
+	/* our slots are NULL in prog->args, so loop over all of them */
+	for (int i = 0; i < cmd->nbArgs; i++)
+	{
+		free(prog->args[i]);
+	}
+	free(prog->args);
+
+	free(cmd->slots);
+	free(cmd);
+}
+
+
+/*
+ * PATH resolution.
+ */
+
+/*
+ * resolve_program_path returns the filename where to find the program name in
+ * the PATH, or NULL when it's not there. The returned string belongs to the
+ * cache and is only valid until the next call.
+ *
+ * Only a cache miss probes the PATH directories. Otherwise we look at the
+ * PATH environment value, and stat() its directories at most once every
+ * PATH_CACHE_RECHECK_MS. When PATH is not set, we use the system default
+ * from confstr(), as execvp() does.
+ *
+ * Returns NULL with errno set to ENOMEM when we're out of memory, and then
+ * the result is not cached.
+ */
+const char *
+resolve_program_path(const char *name)
+{
+	ProgramPathCache *cache = &programPathCache;
+	const char *path = getenv("PATH");
+	ProgramPathEntry *entry;
+	char *filename;
+
+	if (path == NULL)
+	{
+		path = default_path();
+	}
+
+	if (!path_cache_is_valid(cache, path))
+	{
+		reset_program_path_cache();
+
+		cache->path = strdup(path);
+		cache->dirs = filepath_list_new(path);
+
+		if (cache->path == NULL || cache->dirs == NULL)
+		{
+			reset_program_path_cache();
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		cache->mtimes = (struct timespec *)
+			calloc(MAX(cache->dirs->size, 1), sizeof(struct timespec));
+
+		if (cache->mtimes == NULL)
+		{
+			reset_program_path_cache();
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		path_cache_mtimes(cache);
+	}
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		if (strcmp(cache->entries[i].name, name) == 0)
+		{
+			return cache->entries[i].filename;
+		}
+	}
+
+	errno = 0;
+	filename = search_path_dirs(cache->dirs, name);
+
+	if (filename == NULL && errno == ENOMEM)
+	{
+		return NULL;
+	}
+
+	if (cache->count == cache->size)
+	{
+		int size = MAX(16, cache->size * 2);
+		ProgramPathEntry *entries =
+			(ProgramPathEntry *) realloc(cache->entries,
+										 size * sizeof(ProgramPathEntry));
+
+		if (entries == NULL)
+		{
+			free(filename);
+			errno = ENOMEM;
+			return NULL;
+		}
+		cache->entries = entries;
+		cache->size = size;
+	}
+
+	entry = &(cache->entries[cache->count]);
+
+	if ((entry->name = strdup(name)) == NULL)
+	{
+		free(filename);
+		errno = ENOMEM;
+		return NULL;
+	}
+	entry->filename = filename;
+	cache->count++;
+
+	return entry->filename;
+}
+
+
+/*
+ * default_path returns the PATH value to use when it's not set in the
+ * environment, as given by confstr(_CS_PATH).
+ */
+static const char *
+default_path()
+{
+	static char path[PATH_MAX];
+	size_t len;
+
+	if (path[0] != '\0')
+	{
+		return path;
+	}
+
+	len = confstr(_CS_PATH, path, sizeof(path));
+
+	if (len == 0 || len > sizeof(path))
+	{
+		strcpy(path, "/bin:/usr/bin");
+	}
+	return path;
+}
+
+
+/*
+ * reset_program_path_cache releases the PATH resolution cache, which is then
+ * built again at the next resolution.
+ */
+void
+reset_program_path_cache()
+{
+	ProgramPathCache *cache = &programPathCache;
+
+	path_cache_clear_entries(cache);
+	free(cache->entries);
+	free(cache->path);
+	free(cache->mtimes);
+
+	if (cache->dirs != NULL)
+	{
+		filepath_list_free(cache->dirs);
+	}
+
+	memset(cache, 0, sizeof(ProgramPathCache));
+}
+
+
+/*
+ * path_cache_is_valid returns true when the cache has been built for the
+ * given PATH value. When it's time to check the directories again and one of
+ * them changed, we forget the cached entries, and keep the directories.
+ */
+static bool
+path_cache_is_valid(ProgramPathCache *cache, const char *path)
+{
+	uint64_t now;
+	struct timespec *previous;
+	int count;
+
+	if (cache->path == NULL || strcmp(cache->path, path) != 0)
+	{
+		return false;
+	}
+
+	now = monotonic_usecs();
+
+	if (now - cache->checkTime < (uint64_t) PATH_CACHE_RECHECK_MS * 1000)
+	{
+		return true;
+	}
+
+	count = cache->dirs->size;
+	previous = (struct timespec *) malloc(MAX(count, 1) * sizeof(struct timespec));
+
+	/* when we can't compare, assume that something changed */
+	if (previous == NULL)
+	{
+		path_cache_clear_entries(cache);
+		path_cache_mtimes(cache);
+		return true;
+	}
+	memcpy(previous, cache->mtimes, count * sizeof(struct timespec));
+
+	path_cache_mtimes(cache);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (previous[i].tv_sec != cache->mtimes[i].tv_sec ||
+			previous[i].tv_nsec != cache->mtimes[i].tv_nsec)
+		{
+			path_cache_clear_entries(cache);
+			break;
+		}
+	}
+	free(previous);
+
+	return true;
+}
+
+
+/*
+ * path_cache_mtimes fetches the modification time of the PATH directories,
+ * zero for those that don't exist.
+ */
+static void
+path_cache_mtimes(ProgramPathCache *cache)
+{
+	for (int i = 0; i < cache->dirs->size; i++)
+	{
+		struct stat st;
+
+		if (stat(cache->dirs->list[i]->filename, &st) == 0)
+		{
+			cache->mtimes[i] = st.st_mtim;
+		}
+		else
+		{
+			memset(&(cache->mtimes[i]), 0, sizeof(struct timespec));
+		}
+	}
+	cache->checkTime = monotonic_usecs();
+}
+
+
+/*
+ * path_cache_clear_entries forgets about the programs we resolved already.
+ */
+static void
+path_cache_clear_entries(ProgramPathCache *cache)
+{
+	for (int i = 0; i < cache->count; i++)
+	{
+		free(cache->entries[i].name);
+		free(cache->entries[i].filename);
+	}
+	cache->count = 0;
+}
+
+
+/*
+ * search_path_dirs returns a malloc'ed filename for the first executable
+ * regular file with the given name in the directories, or NULL. When we're
+ * out of memory, errno is ENOMEM.
+ */
+static char *
+search_path_dirs(PathList *dirs, const char *name)
+{
+	for (int i = 0; i < dirs->size; i++)
+	{
+		Path *dir = dirs->list[i];
+		char *filename;
+		struct stat st;
+
+		/* directory names from filepath_newdir() end with a slash */
+		filename = (char *) malloc(strlen(dir->filename) + strlen(name) + 1);
+
+		if (filename == NULL)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		sprintf(filename, "%s%s", dir->filename, name);
+
+		if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+			access(filename, X_OK) == 0)
+		{
+			return filename;
+		}
+		free(filename);
+	}
+	return NULL;
+}
+
+
+/*
+ * Result cache.
+ */
+
+/*
+ * open_program_cache opens the given file as the on-disk result cache,
+ * creating it when needed, and makes the entries it contains available. The
+ * results that we cache from now on are appended to it, so that other
+ * processes find them too. Any previous cache is reset first.
+ *
+ * Returns false and sets errno when the file can't be used, the cache then
+ * works in memory only.
+ */
+bool
+open_program_cache(const char *filename)
+{
+	ProgramResultCache *cache = &programResultCache;
+	char magic[PROGRAM_CACHE_MAGIC_LEN];
+	struct stat st;
+	int error = 0;
+
+	reset_program_cache();
+
+	cache->fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+
+	if (cache->fd == -1)
+	{
+		return false;
+	}
+
+	/* other processes append to the file while holding the lock */
+	if (flock(cache->fd, LOCK_EX) == -1 || fstat(cache->fd, &st) == -1)
+	{
+		error = errno;
+	}
+	else if (st.st_size == 0)
+	{
+		if (!write_fully(cache->fd, PROGRAM_CACHE_MAGIC, PROGRAM_CACHE_MAGIC_LEN))
+		{
+			error = errno;
+			(void) ftruncate(cache->fd, 0);
+		}
+	}
+	else if (pread(cache->fd, magic, sizeof(magic), 0) != sizeof(magic)
+			 || memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) != 0)
+	{
+		error = EINVAL;
+	}
+	else
+	{
+		cache->mapSize = st.st_size;
+		cache->map = (char *) mmap(NULL, cache->mapSize, PROT_READ, MAP_SHARED,
+								   cache->fd, 0);
+
+		if (cache->map == MAP_FAILED)
+		{
+			error = errno;
+			cache->map = NULL;
+		}
+		else
+		{
+			size_t end = index_cache_file(cache);
+
+			/* a process died while appending, drop what it left */
+			if (end < cache->mapSize)
+			{
+				(void) ftruncate(cache->fd, end);
+			}
+		}
+	}
+
+	if (error != 0)
+	{
+		reset_program_cache();
+		errno = error;
+		return false;
+	}
+
+	(void) flock(cache->fd, LOCK_UN);
+
+	return true;
+}
+
+
+/*
+ * reset_program_cache forgets all the cached results, and closes the cache
+ * file. The file itself is kept, opening it again finds its entries.
+ */
+void
+reset_program_cache()
+{
+	ProgramResultCache *cache = &programResultCache;
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		free(cache->entries[i].data);
+	}
+	free(cache->entries);
+
+	if (cache->map != NULL)
+	{
+		munmap(cache->map, cache->mapSize);
+	}
+
+	if (cache->fd != -1)
+	{
+		close(cache->fd);
+	}
+
+	memset(cache, 0, sizeof(ProgramResultCache));
+	cache->fd = -1;
+}
+
+
+/*
+ * program_uses_cache returns true when the result of the program is only its
+ * captured output and exit status, which we can then cache. The key doesn't
+ * tell how much of the output we keep, so a tail doesn't use the cache, and
+ * neither do caller's buffers, where a cache hit would have to allocate.
+ */
+static bool
+program_uses_cache(Program *prog)
+{
+	return prog->cacheResult
+		&& prog->capture
+		&& prog->stdoutTail == 0
+		&& prog->stderrTail == 0
+		&& prog->stdoutBuffer == NULL
+		&& prog->stderrBuffer == NULL
+		&& prog->stdoutHook == NULL
+		&& prog->stderrHook == NULL
+		&& prog->stdinData == NULL
+		&& prog->stdinFd == -1
+		&& prog->stdoutFd == -1
+		&& prog->stderrFd == -1
+		&& !prog->recordOutput;
+}
+
+
+/*
+ * program_cache_key builds the cache key of the program in the given buffer,
+ * and returns false when we can't stat() the executable.
+ */
+static bool
+program_cache_key(Program *prog, PQExpBuffer key)
+{
+	/* each string is NUL terminated, so that "a b" and "ab" differ */
+	for (int i = 0; prog->args[i] != NULL; i++)
+	{
+		appendBinaryPQExpBuffer(key, prog->args[i], strlen(prog->args[i]) + 1);
+	}
+	appendPQExpBufferChar(key, '\0');
+
+	if (prog->envp != NULL)
+	{
+		for (int i = 0; prog->envp[i] != NULL; i++)
+		{
+			appendBinaryPQExpBuffer(key, prog->envp[i], strlen(prog->envp[i]) + 1);
+		}
+	}
+	appendPQExpBufferChar(key, '\0');
+
+	if (!append_file_stamp(key, prog->program, prog->execFd))
+	{
+		return false;
+	}
+
+	if (prog->cacheDeps != NULL)
+	{
+		for (int i = 0; prog->cacheDeps[i] != NULL; i++)
+		{
+			appendBinaryPQExpBuffer(key, prog->cacheDeps[i],
+									strlen(prog->cacheDeps[i]) + 1);
+
+			/* a missing dependency is part of the key too */
+			(void) append_file_stamp(key, prog->cacheDeps[i], -1);
+		}
+	}
+
+	return !PQExpBufferBroken(key) && key->len <= UINT32_MAX;
+}
+
+
+/*
+ * append_file_stamp appends the identity of a file to the key: its device,
+ * inode, size and modification time, or zeroes when it doesn't exist. When fd
+ * is not -1 we fstat() that rather than the filename.
+ */
+static bool
+append_file_stamp(PQExpBuffer key, const char *filename, int fd)
+{
+	struct stat st;
+	uint64_t stamp[5] = { 0 };
+	bool found = (fd != -1 ? fstat(fd, &st) : stat(filename, &st)) == 0;
+
+	if (found)
+	{
+		stamp[0] = (uint64_t) st.st_dev;
+		stamp[1] = (uint64_t) st.st_ino;
+		stamp[2] = (uint64_t) st.st_size;
+		stamp[3] = (uint64_t) st.st_mtim.tv_sec;
+		stamp[4] = (uint64_t) st.st_mtim.tv_nsec;
+	}
+	appendBinaryPQExpBuffer(key, (const char *) stamp, sizeof(stamp));
+
+	return found;
+}
+
+
+/*
+ * program_cache_lookup sets the program results from the cache and returns
+ * true when the key is found there. The output is copied, so that the caller
+ * owns it as usual and free_program() releases it. When we can't allocate the
+ * copy, it's a cache miss and the program runs.
+ */
+static bool
+program_cache_lookup(Program *prog, PQExpBuffer key)
+{
+	ProgramResultCache *cache = &programResultCache;
+	uint64_t hash = hash_bytes(key->data, key->len);
+
+	/* the most recent entries come last */
+	for (int i = cache->count - 1; i >= 0; i--)
+	{
+		ProgramCacheEntry *entry = &(cache->entries[i]);
+		char *outData = NULL;
+		char *errData = NULL;
+
+		if (entry->hash != hash
+			|| entry->keyLen != key->len
+			|| memcmp(entry->key, key->data, key->len) != 0)
+		{
+			continue;
+		}
+
+		if (entry->stdout_len > 0)
+		{
+			outData = (char *) malloc(entry->stdout_len + 1);
+		}
+
+		if (entry->stderr_len > 0)
+		{
+			errData = (char *) malloc(entry->stderr_len + 1);
+		}
+
+		if ((entry->stdout_len > 0 && outData == NULL)
+			|| (entry->stderr_len > 0 && errData == NULL))
+		{
+			free(outData);
+			free(errData);
+			return false;
+		}
+
+		if (outData != NULL)
+		{
+			memcpy(outData, entry->stdout, entry->stdout_len);
+			outData[entry->stdout_len] = '\0';
+		}
+		prog->stdout = outData;
+		prog->stdout_len = entry->stdout_len;
+
+		if (errData != NULL)
+		{
+			memcpy(errData, entry->stderr, entry->stderr_len);
+			errData[entry->stderr_len] = '\0';
+		}
+		prog->stderr = errData;
+		prog->stderr_len = entry->stderr_len;
+
+		prog->returnCode = entry->returnCode;
+		prog->error = 0;
+		prog->cacheHit = true;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * program_cache_store adds the results of the program to the cache, and to
+ * the cache file when there's one. Only the results of programs that exited
+ * normally are cached: not those that failed to run, timed out or were killed
+ * by any signal, and not the output we didn't keep in full.
+ */
+static void
+program_cache_store(Program *prog, PQExpBuffer key)
+{
+	ProgramResultCache *cache = &programResultCache;
+	ProgramCacheHeader header;
+	size_t size;
+	char *data;
+
+	if (prog->error != 0 || prog->timedOut || prog->killed
+		|| prog->termSignal != 0
+		|| prog->outputTruncated
+		|| prog->stdout_len < prog->stdoutBytes
+		|| prog->stderr_len < prog->stderrBytes
+		|| prog->stdout_len > MAX_CAPTURE_BUFFER
+		|| prog->stderr_len > MAX_CAPTURE_BUFFER)
+	{
+		return;
+	}
+
+	header.hash = hash_bytes(key->data, key->len);
+	header.keyLen = key->len;
+	header.stdoutLen = prog->stdout_len;
+	header.stderrLen = prog->stderr_len;
+	header.returnCode = prog->returnCode;
+
+	/* the entry is laid out the same in memory and in the file */
+	size = sizeof(header) + header.keyLen + header.stdoutLen + header.stderrLen;
+	data = (char *) malloc(size);
+
+	if (data == NULL)
+	{
+		return;
+	}
+
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + sizeof(header), key->data, header.keyLen);
+	memcpy(data + sizeof(header) + header.keyLen,
+		   prog->stdout, header.stdoutLen);
+	memcpy(data + sizeof(header) + header.keyLen + header.stdoutLen,
+		   prog->stderr, header.stderrLen);
+
+	if (cache->fd != -1 && !append_cache_entry(cache, data, size))
+	{
+		fprintf(stderr, "Failed to write to the program cache: %s\n",
+				strerror(errno));
+	}
+
+	if (program_cache_add(cache, &header, data + sizeof(header), data) == NULL)
+	{
+		free(data);
+	}
+}
+
+
+/*
+ * append_cache_entry appends an entry to the cache file, holding the file lock
+ * so that entries of concurrent processes don't mix. When the write fails
+ * half-way, we truncate the file back to where it was, as an entry cut short
+ * would hide all the entries appended after it.
+ */
+static bool
+append_cache_entry(ProgramResultCache *cache, const char *data, size_t size)
+{
+	struct stat st;
+	bool written;
+
+	if (flock(cache->fd, LOCK_EX) == -1)
+	{
+		return false;
+	}
+
+	if (fstat(cache->fd, &st) == -1)
+	{
+		int error = errno;
+
+		(void) flock(cache->fd, LOCK_UN);
+		errno = error;
+		return false;
+	}
+
+	written = write_fully(cache->fd, data, size);
+
+	if (!written)
+	{
+		int error = errno;
+
+		(void) ftruncate(cache->fd, st.st_size);
+		errno = error;
+	}
+
+	(void) flock(cache->fd, LOCK_UN);
+
+	return written;
+}
+
+
+/*
+ * program_cache_add adds an entry to the cache for a header followed by its
+ * key and output. When data is not NULL, the entry owns it. Returns NULL
+ * when we're out of memory.
+ */
+static ProgramCacheEntry *
+program_cache_add(ProgramResultCache *cache, ProgramCacheHeader *header,
+				  const char *key, char *data)
+{
+	ProgramCacheEntry *entry;
+
+	if (cache->count == cache->size)
+	{
+		int size = MAX(16, cache->size * 2);
+		ProgramCacheEntry *entries =
+			(ProgramCacheEntry *) realloc(cache->entries,
+										  size * sizeof(ProgramCacheEntry));
+
+		if (entries == NULL)
+		{
+			return NULL;
+		}
+		cache->entries = entries;
+		cache->size = size;
+	}
+
+	entry = &(cache->entries[cache->count++]);
+
+	entry->hash = header->hash;
+	entry->key = key;
+	entry->keyLen = header->keyLen;
+	entry->stdout = key + header->keyLen;
+	entry->stdout_len = header->stdoutLen;
+	entry->stderr = entry->stdout + header->stdoutLen;
+	entry->stderr_len = header->stderrLen;
+	entry->returnCode = header->returnCode;
+	entry->data = data;
+
+	return entry;
+}
+
+
+/*
+ * hash_bytes computes the 64 bits FNV-1a hash of the data.
+ */
+static uint64_t
+hash_bytes(const char *data, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+/*
+ * index_cache_file adds the entries of the mmap()ed cache file to the cache,
+ * and returns where the last complete entry ends. An entry that's cut short,
+ * when a process died while appending it, ends the file for us.
+ */
+static size_t
+index_cache_file(ProgramResultCache *cache)
+{
+	size_t pos = PROGRAM_CACHE_MAGIC_LEN;
+
+	while (pos + sizeof(ProgramCacheHeader) <= cache->mapSize)
+	{
+		ProgramCacheHeader header;
+		size_t size;
+
+		/* entries are not aligned in the file */
+		memcpy(&header, cache->map + pos, sizeof(header));
+
+		size = sizeof(header)
+			+ (size_t) header.keyLen
+			+ (size_t) header.stdoutLen
+			+ (size_t) header.stderrLen;
+
+		if (size > cache->mapSize - pos)
+		{
+			break;
+		}
+
+		if (program_cache_add(cache, &header,
+							  cache->map + pos + sizeof(header), NULL) == NULL)
+		{
+			/* the entries are fine, we just can't use them */
+			return cache->mapSize;
+		}
+
+		pos += size;
+	}
+
+	return pos;
+}
+
+
+/*
+ * Builtins.
+ */
+
+/*
+ * register_program_builtin registers a function to call in-process instead of
+ * running the program with the given name. The builtin replaces the program
+ * that we find for that name in the PATH, whether args[0] is the bare name
+ * or a path to that same file, so that "echo" matches "/bin/echo" too, and
+ * not "./scripts/echo". A function registered again for the same name
+ * replaces the previous one. Returns false with errno set to ENOMEM when we
+ * can't add the builtin.
+ */
+bool
+register_program_builtin(const char *name, program_builtin function)
+{
+	ProgramBuiltinRegistry *registry = &programBuiltins;
+	char *builtinName;
+
+	for (int i = 0; i < registry->count; i++)
+	{
+		if (strcmp(registry->entries[i].name, name) == 0)
+		{
+			registry->entries[i].function = function;
+			return true;
+		}
+	}
+
+	if (registry->count == registry->size)
+	{
+		int size = MAX(16, registry->size * 2);
+		ProgramBuiltin *entries =
+			(ProgramBuiltin *) realloc(registry->entries,
+									   size * sizeof(ProgramBuiltin));
+
+		if (entries == NULL)
+		{
+			errno = ENOMEM;
+			return false;
+		}
+		registry->entries = entries;
+		registry->size = size;
+	}
+
+	if ((builtinName = strdup(name)) == NULL)
+	{
+		errno = ENOMEM;
+		return false;
+	}
+
+	registry->entries[registry->count].name = builtinName;
+	registry->entries[registry->count].function = function;
+	registry->count++;
+
+	return true;
+}
+
+
+/*
+ * register_default_builtins registers our builtins for echo, true, false,
+ * which and cat. They implement only what callers of those programs usually
+ * need: echo knows about -n only, and cat only reads small regular files,
+ * larger files are given to the real cat. Returns false when we're out of
+ * memory.
+ */
+bool
+register_default_builtins()
+{
+	return register_program_builtin("echo", &builtin_echo)
+		&& register_program_builtin("true", &builtin_true)
+		&& register_program_builtin("false", &builtin_false)
+		&& register_program_builtin("which", &builtin_which)
+		&& register_program_builtin("cat", &builtin_cat);
+}
+
+
+/*
+ * reset_program_builtins forgets about all the registered builtins.
+ */
+void
+reset_program_builtins()
+{
+	ProgramBuiltinRegistry *registry = &programBuiltins;
+
+	for (int i = 0; i < registry->count; i++)
+	{
+		free(registry->entries[i].name);
+	}
+	free(registry->entries);
+
+	memset(registry, 0, sizeof(ProgramBuiltinRegistry));
+}
+
+
+/*
+ * find_program_builtin returns the builtin registered for the program, or
+ * NULL. Programs that need a stdin, a redirection, or recorded output are
+ * always run as child processes.
+ */
+static program_builtin
+find_program_builtin(Program *prog)
+{
+	ProgramBuiltinRegistry *registry = &programBuiltins;
+	const char *name;
+
+	if (registry->count == 0
+		|| !prog->allowBuiltin
+		|| prog->execFd != -1
+		|| prog->stdinData != NULL
+		|| prog->stdinFd != -1
+		|| prog->stdoutFd != -1
+		|| prog->stderrFd != -1
+		|| prog->recordOutput)
+	{
+		return NULL;
+	}
+
+	name = strrchr(prog->args[0], '/');
+	name = name == NULL ? prog->args[0] : name + 1;
+
+	for (int i = 0; i < registry->count; i++)
+	{
+		if (strcmp(registry->entries[i].name, name) == 0)
+		{
+			return builtin_replaces_program(prog, name)
+				? registry->entries[i].function
+				: NULL;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * builtin_replaces_program returns true when the program to run is the file
+ * that the PATH lookup of name finds. Another executable with the same name,
+ * such as /opt/app/bin/true, is not replaced.
+ */
+static bool
+builtin_replaces_program(Program *prog, const char *name)
+{
+	const char *filename = resolve_program_path(name);
+	struct stat programStat, builtinStat;
+
+	if (filename == NULL)
+	{
+		return false;
+	}
+
+	/* bare names have been resolved with the same lookup */
+	if (strcmp(prog->program, filename) == 0)
+	{
+		return true;
+	}
+
+	return stat(prog->program, &programStat) == 0
+		&& stat(filename, &builtinStat) == 0
+		&& programStat.st_dev == builtinStat.st_dev
+		&& programStat.st_ino == builtinStat.st_ino;
+}
+
+
+/*
+ * run_builtin calls the builtin function and sets the program results from
+ * what it did, as finish_program() does for a child process. The output goes
+ * through the same hooks and capture settings as the output of a child.
+ * Returns false when the builtin asked us to start the program instead.
+ */
+static bool
+run_builtin(Program *prog, program_builtin function)
+{
+	PQExpBufferData out, err;
+	int argc = 0;
+	int rc;
+
+	while (prog->args[argc] != NULL)
+	{
+		argc++;
+	}
+
+	initPQExpBuffer(&out);
+	initPQExpBuffer(&err);
+
+	prog->startTime = monotonic_usecs();
+
+	rc = (*function)(prog, argc, prog->args, &out, &err);
+
+	if (rc == PROGRAM_BUILTIN_SPAWN)
+	{
+		termPQExpBuffer(&out);
+		termPQExpBuffer(&err);
+		return false;
+	}
+
+	prog->ranBuiltin = true;
+	prog->returnCode = rc;
+
+	init_program_stream(prog, &(prog->out), prog->stdoutTail,
+						prog->stdoutBuffer, prog->stdoutBufferSize,
+						-1, prog->stdoutHook, -1);
+	init_program_stream(prog, &(prog->err), prog->stderrTail,
+						prog->stderrBuffer, prog->stderrBufferSize,
+						-1, prog->stderrHook, -1);
+
+	if (PQExpBufferBroken(&out) || PQExpBufferBroken(&err))
+	{
+		prog->returnCode = -1;
+		prog->error = ENOMEM;
+	}
+	else
+	{
+		if (out.len > 0)
+		{
+			process_stream_data(prog, &(prog->out), out.data, out.len);
+		}
+
+		if (err.len > 0)
+		{
+			process_stream_data(prog, &(prog->err), err.data, err.len);
+		}
+	}
+
+	termPQExpBuffer(&out);
+	termPQExpBuffer(&err);
+
+	prog->elapsedMs = (monotonic_usecs() - prog->startTime) / 1000.0;
+	prog->bytesRead = prog->out.bytes + prog->err.bytes;
+	prog->stdoutBytes = prog->out.bytes;
+	prog->stderrBytes = prog->err.bytes;
+
+	prog->stdout = take_stream_data(prog, &(prog->out),
+									&(prog->stdout_len), &(prog->stdoutSpillFd));
+	prog->stderr = take_stream_data(prog, &(prog->err),
+									&(prog->stderr_len), &(prog->stderrSpillFd));
+
+	return true;
+}
+
+
+/*
+ * builtin_echo writes its arguments separated by a space, and a newline
+ * unless the first arguments are -n. Other options, such as -e, and other
+ * arguments that look like options are for the real echo.
+ */
+static int
+builtin_echo(Program *prog, int argc, char **argv,
+			 PQExpBuffer out, PQExpBuffer err)
+{
+	bool newline = true;
+	int first = 1;
+
+	(void) prog;
+	(void) err;
+
+	while (first < argc && strcmp(argv[first], "-n") == 0)
+	{
+		newline = false;
+		first++;
+	}
+
+	for (int i = first; i < argc; i++)
+	{
+		if (argv[i][0] == '-')
+		{
+			return PROGRAM_BUILTIN_SPAWN;
+		}
+	}
+
+	for (int i = first; i < argc; i++)
+	{
+		if (i > first)
+		{
+			appendPQExpBufferChar(out, ' ');
+		}
+		appendPQExpBufferStr(out, argv[i]);
+	}
+
+	if (newline)
+	{
+		appendPQExpBufferChar(out, '\n');
+	}
+
+	return 0;
+}
+
+
+static int
+builtin_true(Program *prog, int argc, char **argv,
+			 PQExpBuffer out, PQExpBuffer err)
+{
+	(void) prog;
+	(void) argc;
+	(void) argv;
+	(void) out;
+	(void) err;
+
+	return 0;
+}
+
+
+static int
+builtin_false(Program *prog, int argc, char **argv,
+			  PQExpBuffer out, PQExpBuffer err)
+{
+	(void) prog;
+	(void) argc;
+	(void) argv;
+	(void) out;
+	(void) err;
+
+	return 1;
+}
+
+
+/*
+ * builtin_which writes where each program is found in the PATH, and returns 1
+ * when one of them is not found. Options, such as -a, are for the real which,
+ * and so is no argument at all, where which returns 1.
+ */
+static int
+builtin_which(Program *prog, int argc, char **argv,
+			  PQExpBuffer out, PQExpBuffer err)
+{
+	int rc = 0;
+
+	(void) prog;
+	(void) err;
+
+	if (argc == 1)
+	{
+		return PROGRAM_BUILTIN_SPAWN;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] == '-')
+		{
+			return PROGRAM_BUILTIN_SPAWN;
+		}
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char *filename = argv[i];
+
+		if (strchr(argv[i], '/') == NULL)
+		{
+			filename = resolve_program_path(argv[i]);
+		}
+		else if (access(argv[i], X_OK) != 0)
+		{
+			filename = NULL;
+		}
+
+		if (filename == NULL)
+		{
+			rc = 1;
+			continue;
+		}
+		appendPQExpBuffer(out, "%s\n", filename);
+	}
+
+	return rc;
+}
+
+
+/*
+ * builtin_cat writes the contents of the files. Unless they all are small
+ * regular files, or missing, we prefer to run the real cat. Files that report
+ * a zero size might not be empty, such as most of /proc, and /proc/self would
+ * be ours rather than the child's: those are for the real cat too.
+ */
+static int
+builtin_cat(Program *prog, int argc, char **argv,
+			PQExpBuffer out, PQExpBuffer err)
+{
+	int rc = 0;
+
+	(void) prog;
+
+	for (int i = 1; i < argc; i++)
+	{
+		struct stat st;
+
+		/* options, and "-" for stdin, are for the real cat */
+		if (argv[i][0] == '-')
+		{
+			return PROGRAM_BUILTIN_SPAWN;
+		}
+
+		if (strncmp(argv[i], "/proc/", 6) == 0)
+		{
+			return PROGRAM_BUILTIN_SPAWN;
+		}
+
+		if (stat(argv[i], &st) == 0
+			&& (!S_ISREG(st.st_mode)
+				|| st.st_size == 0
+				|| st.st_size > BUILTIN_CAT_MAX_SIZE))
+		{
+			return PROGRAM_BUILTIN_SPAWN;
+		}
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		char buffer[BUFSIZE];
+		ssize_t bytes;
+		int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+
+		if (fd == -1)
+		{
+			appendPQExpBuffer(err, "cat: %s: %s\n", argv[i], strerror(errno));
+			rc = 1;
+			continue;
+		}
+
+		while ((bytes = read(fd, buffer, sizeof(buffer))) > 0
+			   || (bytes == -1 && errno == EINTR))
+		{
+			if (bytes > 0)
+			{
+				appendBinaryPQExpBuffer(out, buffer, bytes);
+			}
+		}
+
+		if (bytes == -1)
+		{
+			appendPQExpBuffer(err, "cat: %s: %s\n", argv[i], strerror(errno));
+			rc = 1;
+		}
+		close(fd);
+	}
+
+	return rc;
+}
+
+
+/*
+ * Co-processes.
+ *
+ * Starting a process costs a fork() and exec(), and then the program startup
+ * time. For helpers that we call very often, we start the process only once
+ * and keep its stdin and stdout pipes open, so that each call costs a pipe
+ * round-trip instead.
+ */
+
+/*
+ * start_coprocess starts the given program as a co-process. The returned
+ * Coprocess prog slot settings (spawnMethod, setsid, timeoutMs and
+ * killGraceMs) apply to the next start of the child, and timeoutMs is used
+ * as a per-call timeout.
+ *
+ * Returns NULL with errno set when the program could not be started.
+ */
+Coprocess *
+start_coprocess(char **args, CoprocessFraming framing)
+{
+	Coprocess *cop = (Coprocess *) malloc(sizeof(Coprocess));
+
+	if (cop == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cop->prog = initialize_program(args, false);
+	cop->framing = framing;
+	cop->restarts = 0;
+	cop->inFd = cop->outFd = cop->errFd = -1;
+	cop->consumed = 0;
+
+	initPQExpBuffer(&(cop->request));
+	initPQExpBuffer(&(cop->outbuf));
+	initPQExpBuffer(&(cop->errbuf));
+
+	if (!spawn_coprocess(cop))
+	{
+		int err = cop->prog.error;
+
+		stop_coprocess(cop);
+		errno = err;
+		return NULL;
+	}
+
+	return cop;
+}
+
+
+/*
+ * call_coprocess sends a request to the co-process and waits for its
+ * response. The response points into the Coprocess buffer and is only valid
+ * until the next call. With line framing it's NUL terminated, and doesn't
+ * contain the newline.
+ *
+ * The child is (re)started when it is not running anymore. When it dies, or
+ * times out, during the call we return false with cop->prog.error set, and
+ * the next call starts a new child: retrying is left to the caller, as we
+ * don't know if the request has been processed.
+ *
+ * The whole request is written before we look for a response. A child that
+ * sent more than one frame for the previous request is out of sync with us:
+ * we then return false with EPROTO without sending the request, and the next
+ * call starts a new child.
+ */
+bool
+call_coprocess(Coprocess *cop, const char *request, size_t len,
+			   const char **response, size_t *responseLen)
+{
+	Program *prog = &(cop->prog);
+	size_t written = 0;
+	uint64_t deadline = 0;
+
+	prog->error = 0;
+
+	if (!coprocess_is_running(cop))
+	{
+		coprocess_close_child(cop, 0);
+		cop->restarts++;
+
+		if (!spawn_coprocess(cop))
+		{
+			return false;
+		}
+	}
+
+	/* forget about the previous response */
+	if (cop->consumed > 0)
+	{
+		cop->outbuf.len -= cop->consumed;
+		memmove(cop->outbuf.data, cop->outbuf.data + cop->consumed,
+				cop->outbuf.len + 1);
+		cop->consumed = 0;
+	}
+	resetPQExpBuffer(&(cop->errbuf));
+
+	/* any data from the child now is not a response to this request */
+	if (!coprocess_read(cop, cop->outFd, &(cop->outbuf)))
+	{
+		prog->error = prog->error != 0 ? prog->error : EPIPE;
+		coprocess_close_child(cop, SIGKILL);
+		return false;
+	}
+	else if (cop->outbuf.len > 0)
+	{
+		prog->error = EPROTO;
+		coprocess_close_child(cop, SIGKILL);
+		return false;
+	}
+
+	/* prepare the framed request */
+	resetPQExpBuffer(&(cop->request));
+
+	if (cop->framing == COPROCESS_FRAME_LENGTH)
+	{
+		uint32_t header = htonl((uint32_t) len);
+
+		appendBinaryPQExpBuffer(&(cop->request), (char *) &header,
+								sizeof(header));
+	}
+	appendBinaryPQExpBuffer(&(cop->request), request, len);
+
+	if (cop->framing == COPROCESS_FRAME_LINE
+		&& (len == 0 || request[len - 1] != '\n'))
+	{
+		appendPQExpBufferChar(&(cop->request), '\n');
+	}
+
+	if (PQExpBufferDataBroken(cop->request))
+	{
+		prog->error = ENOMEM;
+		return false;
+	}
+
+	if (prog->timeoutMs > 0)
+	{
+		deadline = monotonic_usecs() + (uint64_t) prog->timeoutMs * 1000;
+	}
+
+	while (written < cop->request.len
+		   || !coprocess_response(cop, response, responseLen))
+	{
+		struct pollfd fds[3];
+		int timeout = -1;
+		int ready;
+
+		fds[0].fd = cop->outFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = cop->errFd;
+		fds[1].events = POLLIN;
+		fds[2].fd = written < cop->request.len ? cop->inFd : -1;
+		fds[2].events = POLLOUT;
+
+		if (deadline > 0)
+		{
+			uint64_t now = monotonic_usecs();
+
+			timeout = now >= deadline ? 0 : (int) ((deadline - now + 999) / 1000);
+		}
+
+		ready = poll(fds, 3, timeout);
+
+		if (ready == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+			{
+				continue;
+			}
+			prog->error = errno;
+			coprocess_close_child(cop, SIGKILL);
+			return false;
+		}
+		else if (ready == 0)
+		{
+			prog->timedOut = true;
+			prog->error = ETIMEDOUT;
+			coprocess_close_child(cop, SIGKILL);
+			return false;
+		}
+
+		if (fds[2].fd != -1 && fds[2].revents != 0)
+		{
+			ssize_t bytes = write_to_child(cop->inFd,
+										   cop->request.data + written,
+										   cop->request.len - written);
+
+			if (bytes > 0)
+			{
+				written += bytes;
+			}
+			else if (errno != EINTR && errno != EAGAIN)
+			{
+				prog->error = errno;
+				coprocess_close_child(cop, SIGKILL);
+				return false;
+			}
+		}
+
+		if (fds[1].revents != 0 && !coprocess_read(cop, cop->errFd,
+												   &(cop->errbuf)))
+		{
+			/* the child closed its stderr, that's fine */
+			close(cop->errFd);
+			cop->errFd = -1;
+		}
+
+		if (fds[0].revents != 0 && !coprocess_read(cop, cop->outFd,
+												   &(cop->outbuf)))
+		{
+			/* the child is gone, unless we got the response already */
+			if (written == cop->request.len
+				&& coprocess_response(cop, response, responseLen))
+			{
+				break;
+			}
+
+			prog->error = prog->error != 0 ? prog->error : EPIPE;
+			coprocess_close_child(cop, SIGKILL);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * stop_coprocess closes the child stdin so that it exits, waits for it for
+ * killGraceMs and then kills it, and releases the Coprocess memory.
+ */
+void
+stop_coprocess(Coprocess *cop)
+{
+	coprocess_close_child(cop, SIGTERM);
+
+	termPQExpBuffer(&(cop->request));
+	termPQExpBuffer(&(cop->outbuf));
+	termPQExpBuffer(&(cop->errbuf));
+
+	free_program(&(cop->prog));
+	free(cop);
+}
+
+
+/*
+ * spawn_coprocess starts the child process with pipes for its stdin, stdout
+ * and stderr, that we keep open. All our ends are close-on-exec, so that
+ * other children don't inherit them.
+ */
+static bool
+spawn_coprocess(Coprocess *cop)
+{
+	Program *prog = &(cop->prog);
+	int inpipe[2] = {-1,-1};
+	int outpipe[2] = {-1,-1};
+	int errpipe[2] = {-1,-1};
+
+	prog->reaped = false;
+	prog->timedOut = false;
+	prog->termSignal = 0;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if (pipe2(inpipe, O_CLOEXEC) < 0
+		|| pipe2(outpipe, O_CLOEXEC) < 0
+		|| pipe2(errpipe, O_CLOEXEC) < 0)
+	{
+		prog->error = errno;
+
+		close_pipe(inpipe);
+		close_pipe(outpipe);
+		close_pipe(errpipe);
+		return false;
+	}
+
+	if (prog->spawnMethod == PROGRAM_SPAWN_POSIX_SPAWN)
+	{
+		prog->pid = spawn_program(prog, inpipe, outpipe, errpipe);
+	}
+	else
+	{
+		prog->pid = fork_program(prog, inpipe, outpipe, errpipe);
+	}
+
+	close(inpipe[0]);
+	close(outpipe[1]);
+	close(errpipe[1]);
+
+	if (prog->pid == -1)
+	{
+		close(inpipe[1]);
+		close(outpipe[0]);
+		close(errpipe[0]);
+		return false;
+	}
+
+	prog->startTime = monotonic_usecs();
+	prog->pidfd = open_pidfd(prog->pid);
+
+	cop->inFd = inpipe[1];
+	cop->outFd = outpipe[0];
+	cop->errFd = errpipe[0];
+
+	if (!set_nonblocking(cop->inFd)
+		|| !set_nonblocking(cop->outFd)
+		|| !set_nonblocking(cop->errFd))
+	{
+		prog->error = errno;
+		coprocess_close_child(cop, SIGKILL);
+		return false;
+	}
+
+	/* data from a previous child is meaningless now */
+	resetPQExpBuffer(&(cop->outbuf));
+	cop->consumed = 0;
+
+	return true;
+}
+
+
+/*
+ * coprocess_is_running returns true when the child is still running.
+ */
+static bool
+coprocess_is_running(Coprocess *cop)
+{
+	Program *prog = &(cop->prog);
+
+	if (prog->pid == -1 || prog->reaped)
+	{
+		return false;
+	}
+
+	if (prog->pidfd != -1)
+	{
+		struct pollfd fd = { prog->pidfd, POLLIN, 0 };
+
+		return poll(&fd, 1, 0) == 0;
+	}
+
+	wait_for_program(prog, WNOHANG);
+
+	return !prog->reaped;
+}
+
+
+/*
+ * coprocess_close_child closes our ends of the child pipes, which should make
+ * it exit, and then waits for it. When sig is not zero and the child is still
+ * running after killGraceMs, we send it sig and then SIGKILL.
+ */
+static void
+coprocess_close_child(Coprocess *cop, int sig)
+{
+	Program *prog = &(cop->prog);
+
+	if (cop->inFd != -1)
+	{
+		close(cop->inFd);
+	}
+
+	if (cop->outFd != -1)
+	{
+		close(cop->outFd);
+	}
+
+	if (cop->errFd != -1)
+	{
+		close(cop->errFd);
+	}
+	cop->inFd = cop->outFd = cop->errFd = -1;
+
+	if (prog->pid != -1 && !prog->reaped)
+	{
+		if (sig == SIGKILL)
+		{
+			signal_program(prog, SIGKILL);
+		}
+		else if (sig != 0 && !coprocess_wait(prog, prog->killGraceMs))
+		{
+			signal_program(prog, sig);
+
+			if (!coprocess_wait(prog, prog->killGraceMs))
+			{
+				signal_program(prog, SIGKILL);
+			}
+		}
+
+		if (!prog->reaped)
+		{
+			wait_for_program(prog, 0);
+		}
+	}
+
+	if (prog->pidfd != -1)
+	{
+		close(prog->pidfd);
+		prog->pidfd = -1;
+	}
+	prog->pid = -1;
+}
+
+
+/*
+ * coprocess_wait waits for at most timeoutMs for the child to exit, and
+ * returns true when it did. Without a pidfd we can't poll() for that, so we
+ * check with WNOHANG every few milliseconds, which also reaps the child.
+ */
+static bool
+coprocess_wait(Program *prog, int timeoutMs)
+{
+	uint64_t deadline = monotonic_usecs() + (uint64_t) timeoutMs * 1000;
+
+	if (prog->pidfd != -1)
+	{
+		struct pollfd fd = { prog->pidfd, POLLIN, 0 };
+
+		return poll(&fd, 1, timeoutMs) != 0;
+	}
+
+	for (;;)
+	{
+		wait_for_program(prog, WNOHANG);
+
+		if (prog->reaped)
+		{
+			return true;
+		}
+
+		if (monotonic_usecs() >= deadline)
+		{
+			return false;
+		}
+
+		(void) poll(NULL, 0, 10);
+	}
+}
+
+
+/*
+ * coprocess_response returns true when we have a complete response frame in
+ * our buffer, and then sets response and responseLen.
+ */
+static bool
+coprocess_response(Coprocess *cop, const char **response, size_t *responseLen)
+{
+	PQExpBuffer buffer = &(cop->outbuf);
+
+	if (cop->framing == COPROCESS_FRAME_LINE)
+	{
+		char *newline = memchr(buffer->data, '\n', buffer->len);
+
+		if (newline == NULL)
+		{
+			return false;
+		}
+
+		*newline = '\0';
+		*response = buffer->data;
+		*responseLen = newline - buffer->data;
+		cop->consumed = *responseLen + 1;
+
+		return true;
+	}
+	else
+	{
+		uint32_t header;
+		size_t len;
+
+		if (buffer->len < sizeof(header))
+		{
+			return false;
+		}
+
+		memcpy(&header, buffer->data, sizeof(header));
+		len = ntohl(header);
+
+		if (buffer->len < sizeof(header) + len)
+		{
+			return false;
+		}
+
+		*response = buffer->data + sizeof(header);
+		*responseLen = len;
+		cop->consumed = sizeof(header) + len;
+
+		return true;
+	}
+}
+
+
+/*
+ * coprocess_read reads from one of the co-process pipes until it's empty, and
+ * returns false when we reached EOF or an error.
+ */
+static bool
+coprocess_read(Coprocess *cop, int filedes, PQExpBuffer buffer)
+{
+	for (;;)
+	{
+		ssize_t bytes = read_into_buf(filedes, buffer,
+									  BUFSIZE, MAX_CAPTURE_BUFFER);
+
+		if (bytes > 0)
+		{
+			continue;
+		}
+		else if (bytes == 0)
+		{
+			return false;
+		}
+		else if (errno == EINTR)
+		{
+			continue;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return true;
+		}
+		else
+		{
+			cop->prog.error = errno;
+			return false;
+		}
 	}
-	return bytes;
 }
 
 